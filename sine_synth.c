@@ -1,52 +1,51 @@
 #include <math.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
+#include <time.h>
 
 #include "sine_synth.h"
+#include "sine_synth_trace.h"
+#include "sine_synth_tuning.h"
+#include "sine_synth_wavetable.h"
 
 #define DB_CO(g) ((g) > -90.0f ? powf(10.0f, (g) * 0.05f) : 0.0f)
 #define N_VOICES (128)
-#define N_TABLE_SIZE (2048)
+// Voices are allocated by activate() in chunks, as many as the polyphony
+// port asks for or the polyphony played so far
+#define N_VOICE_CHUNK (16)
+#define N_VOICE_CHUNKS (N_VOICES / N_VOICE_CHUNK)
+// Spare voices allocated above the peak polyphony
+#define VOICE_HEADROOM (N_VOICE_CHUNK / 2)
 #define PI (3.14159265358979323846)
 #define TWO_PI (2 * PI)
 #define PIOVR2 (PI/2)
 #define ROOT2OVR2 (sqrt(2) * 0.5)
-#define TABLE_INCREMENT (TWO_PI/N_TABLE_SIZE)
-
-const float MIDI_NOTES[128] = {
-  8.1757989156, 8.6619572180, 9.1770239974, 9.7227182413, 10.3008611535,
-  10.9133822323, 11.5623257097, 12.2498573744, 12.9782717994,
-  13.7500000000, 14.5676175474, 15.4338531643, 16.3515978313,
-  17.3239144361, 18.3540479948, 19.4454364826, 20.6017223071,
-  21.8267644646, 23.1246514195, 24.4997147489, 25.9565435987,
-  27.5000000000, 29.1352350949, 30.8677063285, 32.7031956626,
-  34.6478288721, 36.7080959897, 38.8908729653, 41.2034446141,
-  43.6535289291, 46.2493028390, 48.9994294977, 51.9130871975,
-  55.0000000000, 58.2704701898, 61.7354126570, 65.4063913251,
-  69.2956577442, 73.4161919794, 77.7817459305, 82.4068892282,
-  87.3070578583, 92.4986056779, 97.9988589954, 103.8261743950,
-  110.0000000000, 116.5409403795, 123.4708253140, 130.8127826503,
-  138.5913154884, 146.8323839587, 155.5634918610, 164.8137784564,
-  174.6141157165, 184.9972113558, 195.9977179909, 207.6523487900,
-  220.0000000000, 233.0818807590, 246.9416506281, 261.6255653006,
-  277.1826309769, 293.6647679174, 311.1269837221, 329.6275569129,
-  349.2282314330, 369.9944227116, 391.9954359817, 415.3046975799,
-  440.0000000000, 466.1637615181, 493.8833012561, 523.2511306012,
-  554.3652619537, 587.3295358348, 622.2539674442, 659.2551138257,
-  698.4564628660, 739.9888454233, 783.9908719635, 830.6093951599,
-  880.0000000000, 932.3275230362, 987.7666025122, 1046.5022612024,
-  1108.7305239075, 1174.6590716696, 1244.5079348883, 1318.5102276515,
-  1396.9129257320, 1479.9776908465, 1567.9817439270, 1661.2187903198,
-  1760.0000000000, 1864.6550460724, 1975.5332050245, 2093.0045224048,
-  2217.4610478150, 2349.3181433393, 2489.0158697766, 2637.0204553030,
-  2793.8258514640, 2959.9553816931, 3135.9634878540, 3322.4375806396,
-  3520.0000000000, 3729.3100921447, 3951.0664100490, 4186.0090448096,
-  4434.9220956300, 4698.6362866785, 4978.0317395533, 5274.0409106059,
-  5587.6517029281, 5919.9107633862, 6271.9269757080, 6644.8751612791,
-  7040.0000000000, 7458.6201842894, 7902.1328200980, 8372.0180896192,
-  8869.8441912599, 9397.2725733570, 9956.0634791066, 10548.0818212118,
-  11175.3034058561, 11839.8215267723, 12543.8539514160
-};
+#define TABLE_SCALE ((float)(N_TABLE_SIZE/TWO_PI))
+#define CONTROL_PERIOD_DEFAULT (32)
+#define N_EVENTS (256)
+// Internal processing grid, must divide every control period
+#define N_SUB_BLOCK (16)
+#define N_MAX_PATH (1024)
+#define N_WAVETABLE_SLOTS (2)
+// Pan positions from hard left to hard right
+#define N_PAN_TABLE (1024)
+// Key tracked spread pans notes this far from middle C fully to a side
+#define SPREAD_KEY_RANGE (48.0f)
+
+// Governor: fraction of the block duration run() may take before quality
+// is reduced, and below which it is restored after GOVERNOR_CALM_S
+#define GOVERNOR_HIGH (0.7f)
+#define GOVERNOR_LOW (0.35f)
+#define GOVERNOR_WINDOW_S (0.005)
+#define GOVERNOR_SMOOTHING_S (0.05)
+#define GOVERNOR_HOLD_S (0.1)
+#define GOVERNOR_CALM_S (2.0)
+#define GOVERNOR_RELEASE_MS (5.0f)
+#define N_GOVERNOR_LEVELS (4)
 
 typedef enum {
   ATTACK = 0,
@@ -61,6 +60,26 @@ typedef struct {
   uint8_t velocity;
   float phase;
   float phase_increment;
+  float phase_increment_step;
+  float note_increment;
+
+  float lfo_phase;
+
+  // Offset from the panning position, set on note on by the stereo spread
+  float pan;
+
+  // Band-limited level of the wave tables for the current pitch
+  uint32_t mipmap;
+
+  // Frame of the current block the voice has been rendered up to
+  uint32_t rendered_to;
+
+  /* Output gains (volume, pan and amplitude modulation folded together),
+     interpolated towards the next control tick */
+  float gain_left;
+  float gain_left_step;
+  float gain_right;
+  float gain_right_step;
 
   float envelope_index;
   float envelope_level;
@@ -77,6 +96,72 @@ typedef struct {
   VoiceStatus status;
 } Voice;
 
+typedef enum {
+  WORK_LOAD_WAVETABLE = 0,
+  WORK_FREE_WAVETABLE,
+  WORK_LOAD_SCALE,
+  WORK_LOAD_KEYMAP,
+  WORK_FREE_TUNING
+} WorkType;
+
+// Files saved with the session, wave table slots first
+typedef enum {
+  PATH_WAVETABLE_A = 0,
+  PATH_WAVETABLE_B,
+  PATH_SCALE,
+  PATH_KEYMAP,
+  N_PATHS
+} PathIndex;
+
+/*
+ * Worker message, load requests are followed by the null terminated path,
+ * an empty path restores the default
+ */
+typedef struct {
+  WorkType type;
+  uint32_t slot;
+  union {
+    Wavetable* table;
+    Tuning* tuning;
+  };
+} WorkMessage;
+
+typedef struct {
+  uint32_t frame;
+  uint8_t type;
+  uint8_t note;
+  uint8_t velocity;
+} NoteEvent;
+
+/*
+ * Quality steps, each level keeps the reductions of the ones below
+ */
+typedef enum {
+  GOVERNOR_FULL = 0,
+  GOVERNOR_CONTROL_RATE,  // Modulation every 64 samples
+  GOVERNOR_NO_MORPH,      // Single wave table per voice, the nearest
+  GOVERNOR_VOICES_64,     // Quietest voices past the cap released early
+  GOVERNOR_VOICES_32
+} GovernorLevel;
+
+typedef struct {
+  GovernorLevel level;
+
+  // run() time and frames since the load was last updated, hosts that
+  // split their cycle at events call run() with tiny blocks
+  double window_time;
+  uint32_t window_frames;
+
+  // Smoothed run() time over block duration
+  float load;
+
+  // Frames before another step down, so the last one shows in the load
+  uint32_t hold;
+
+  // Frames spent below GOVERNOR_LOW
+  uint32_t calm;
+} Governor;
+
 typedef struct {
   double sample_rate;
   double sample_rate_ms;
@@ -89,31 +174,141 @@ typedef struct {
   const float* sustain_level;
   const float* decay_time;
   const float* release_time;
+  const float* lfo_global_rate;
+  const float* lfo_voice_rate;
+  const float* mod_global_pitch;
+  const float* mod_global_amp;
+  const float* mod_global_pan;
+  const float* mod_voice_pitch;
+  const float* mod_voice_amp;
+  const float* mod_voice_pan;
+  const float* control_rate;
+  const float* wave_morph;
+  const float* governor_enabled;
+  const float* freewheel;
+  float* governor_level;
+  float* dsp_load;
+  const float* stereo_spread;
+  const float* spread_mode;
+  float* memory;
+  const float* polyphony;
 
   float volume_coef;
-  float pan_left;
-  float pan_right;
+  float morph;
   float attack_duration;
   float hold_duration;
   float decay_duration;
   float release_duration;
 
+  uint32_t control_period;
+  uint32_t control_countdown;
+
+  Governor governor;
+  uint8_t max_voices;
+
+  float lfo_global_phase;
+  float lfo_global_value;
+  float lfo_global_increment;
+  float lfo_voice_increment;
+
   float* out_left;
   float* out_right;
 
-  float wave_table[N_TABLE_SIZE];
+  // Block frame offset of the sub-block grid, which runs from stream start
+  // independently of the host buffer size
+  uint32_t sub_block_offset;
+
+  float scratch_osc[N_SUB_BLOCK] __attribute__((aligned(16)));
+  float scratch_env[N_SUB_BLOCK] __attribute__((aligned(16)));
+
+  // Built-in sine, also used by the LFOs, shared by all instances
+  const Wavetable* sine;
+
+  // Side of the last voice in alternating spread mode
+  bool spread_right;
+
+  // Slot A falls back to the sine and slot B to slot A when unset. Swapped
+  // in by work_response(), replaced tables are freed by the worker.
+  _Atomic(Wavetable*) wavetables[N_WAVETABLE_SLOTS];
+
+  // Phase increment of every note, swapped in like the wave tables
+  _Atomic(Tuning*) tuning;
+
+  // Loaded Scala files, only touched by the worker and restore()
+  Scale* scale;
+  Keymap* keymap;
+
+  // Paths of the loaded files, empty for the defaults
+  char paths[N_PATHS][N_MAX_PATH];
+
+  // Held around the Scala files and paths by the worker, save() and
+  // restore(), never by the audio thread
+  pthread_mutex_t files_lock;
+
+  // Bytes of the Scala files, for the memory report
+  _Atomic(uint32_t) worker_footprint;
+
+  // Voice i is voice_chunks[i / N_VOICE_CHUNK][i % N_VOICE_CHUNK]
+  Voice* voice_chunks[N_VOICE_CHUNKS];
+  uint8_t voice_chunks_n;
+
+  // Most voices wanted at once, counting stolen ones, sizes the chunks
+  // allocated by activate()
+  uint8_t voices_peak;
+
+  // Voices stolen since a note last found a free one
+  uint8_t voices_stolen;
 
-  Voice* voices[N_VOICES];
   uint8_t active_voices_i[N_VOICES];
   uint8_t active_voices_n;
 
+  NoteEvent events[N_EVENTS];
+  uint32_t events_n;
+  uint32_t events_i;
+
   LV2_URID_Map* map;
+  LV2_Worker_Schedule* schedule;
+
+  TRACE_FIELD
 
   struct {
     LV2_URID midi_MidiEvent;
+    LV2_URID atom_Blank;
+    LV2_URID atom_Object;
+    LV2_URID atom_Path;
+    LV2_URID atom_URID;
+    LV2_URID patch_Set;
+    LV2_URID patch_property;
+    LV2_URID patch_value;
+    LV2_URID wavetable_a;
+    LV2_URID wavetable_b;
+    LV2_URID scale;
+    LV2_URID keymap;
   } uris;
 } SineSynth;
 
+/*
+ * Tables no instance writes, built once by the first instantiate(). They
+ * are static, so they go away with the plugin.
+ */
+static pthread_once_t shared_once = PTHREAD_ONCE_INIT;
+
+static struct {
+  // Constant power left and right gains of every pan position
+  float pan[N_PAN_TABLE + 1][2];
+} shared;
+
+// Built-in single level sine
+static union {
+  Wavetable table;
+  uint8_t storage[sizeof(Wavetable) + sizeof(float[N_TABLE_SIZE])];
+} shared_sine;
+
+static inline Voice*
+get_voice(uint8_t i_voice, SineSynth* self) {
+  return &self->voice_chunks[i_voice / N_VOICE_CHUNK][i_voice % N_VOICE_CHUNK];
+}
+
 /*
  * Calculate adsr for current voice
  */
@@ -185,307 +380,1171 @@ adsr(Voice* voice) {
   return level;
 }
 
-static void
-fill_wave_table(SineSynth* self) {
-  for(int i=0; i<N_TABLE_SIZE; i++) {
-    self->wave_table[i] = sin(i * TABLE_INCREMENT);
-  }
+static inline float
+table_lookup(const float* table, float phase) {
+  // Phases are never negative, truncating after the offset rounds
+  return table[(int)(phase * TABLE_SCALE + 0.5f) & (N_TABLE_SIZE - 1)];
 }
 
 static float
 sin_table(float phase, SineSynth* self) {
-  return self->wave_table[(int)roundf(phase/TABLE_INCREMENT)];
+  return table_lookup(self->sine->levels[0], phase);
+}
+
+/*
+ * Resolve the wave table levels a voice reads from
+ */
+static void
+voice_tables(const Voice* voice, SineSynth* self,
+             const float** table_a, const float** table_b) {
+  const Wavetable* a = atomic_load_explicit(&self->wavetables[0], memory_order_relaxed);
+  const Wavetable* b = atomic_load_explicit(&self->wavetables[1], memory_order_relaxed);
+
+  *table_a = wavetable_level(a ? a : self->sine, voice->mipmap);
+  *table_b = b ? wavetable_level(b, voice->mipmap) : *table_a;
 }
 
 /*
  * Render a voice sample
  */
-static float
-tick_voice(Voice* voice, SineSynth* self) {
-  float val = sin_table(voice->phase, self);
+static inline float
+tick_oscillator(Voice* voice, const float* table_a, const float* table_b, float morph) {
+  float a   = table_lookup(table_a, voice->phase);
+  float val = a + morph * (table_lookup(table_b, voice->phase) - a);
 
   voice->phase += voice->phase_increment;
-  if (voice->phase > TWO_PI) {
+  if (voice->phase >= TWO_PI) {
     voice->phase -= TWO_PI;
   }
+  voice->phase_increment += voice->phase_increment_step;
+
+  return val;
+}
 
+static inline float
+tick_envelope(Voice* voice) {
   voice->envelope_level = adsr(voice);
 
   if (voice->status != SUSTAIN) {
     voice->envelope_index++;
   }
 
-  return val * voice->envelope_level;
+  return voice->envelope_level;
 }
 
-/*
- * Get active voice assigned to note
- */
-static Voice*
-get_active_voice(uint8_t note, SineSynth* self) {
-  for(int i_voice=0; i_voice < self->active_voices_n; i_voice++) {
-    int ai_voice = self->active_voices_i[i_voice];
-    Voice* voice = self->voices[ai_voice];
+static float
+tick_voice(Voice* voice, const float* table_a, const float* table_b, float morph) {
+  float val = tick_oscillator(voice, table_a, table_b, morph);
 
-    if (voice->note == note) {
-      return voice;
-    }
+  return val * tick_envelope(voice);
+}
+
+static float
+wrap_phase(float phase) {
+  while (phase >= TWO_PI) {
+    phase -= TWO_PI;
   }
 
-  return NULL;
+  return phase;
 }
 
-/*
- * Activate voice and return it
- */
-static Voice*
-activate_voice(SineSynth* self) {
-  for(int i_voice=0; i_voice < N_VOICES; i_voice++) {
-    Voice* voice = self->voices[i_voice];
+static void
+build_shared(void) {
+  wavetable_sine(&shared_sine.table);
 
-    if (voice->velocity == 0) {
-      self->active_voices_i[self->active_voices_n++] = i_voice;
+  for (int i = 0; i <= N_PAN_TABLE; i++) {
+    double position = 2.0 * i / N_PAN_TABLE - 1;
+    double angle    = position * PIOVR2 * 0.5 + PI;
 
-      return voice;
-    }
+    shared.pan[i][0] = ROOT2OVR2 * (cos(angle) - sin(angle));
+    shared.pan[i][1] = ROOT2OVR2 * (cos(angle) + sin(angle));
   }
-
-  return NULL;
 }
 
+/*
+ * Constant power pan gains for position in [-1, 1]
+ */
 static void
-note_on(uint8_t note, uint8_t velocity, SineSynth* self) {
-  Voice* voice = get_active_voice(note, self);
+pan_gains(float position, float* left, float* right) {
+  const float* gains = shared.pan[(int)((position + 1) * (N_PAN_TABLE / 2) + 0.5f)];
 
-  if (voice != NULL) {
-    // Voice is in release phase, reattack from current envelope level
-    voice->status = ATTACK;
-    voice->envelope_index = voice->attack_duration * (voice->envelope_level / voice->attack_level);
+  *left  = gains[0];
+  *right = gains[1];
+}
 
-    return;
-  }
+/*
+ * Pan offset of a new voice, proportional to the distance of its note
+ * from middle C or alternately to the left and right
+ */
+static float
+voice_pan(uint8_t note, SineSynth* self) {
+  const float spread = *self->stereo_spread;
 
-  // Activate voice and assign note to it
-  voice = activate_voice(self);
+  if (spread <= 0) {
+    return 0;
+  }
 
-  if (voice != NULL) {
-    voice->note = note;
-    voice->velocity = velocity;
+  if (*self->spread_mode >= 0.5f) {
+    self->spread_right = !self->spread_right;
 
-    voice->phase = 0;
-    voice->phase_increment = (MIDI_NOTES[note] * TWO_PI) / self->sample_rate;
+    return self->spread_right ? spread : -spread;
+  }
 
-    voice->status = ATTACK;
-    voice->envelope_index = 0;
-    voice->released_envelope_level = 0;
+  float offset = (note - 60) / SPREAD_KEY_RANGE;
 
-    voice->attack_level = 1;
-    voice->attack_duration = self->attack_duration;
-    voice->hold_duration = self->hold_duration;
-    voice->decay_duration = self->decay_duration;
-    voice->release_duration = self->release_duration;
-    voice->sustain_level = *self->sustain_level;
+  if (offset < -1) {
+    offset = -1;
   }
+  else if (offset > 1) {
+    offset = 1;
+  }
+
+  return spread * offset;
 }
 
-static void
-note_off(uint8_t note, SineSynth* self) {
-  Voice* voice = get_active_voice(note, self);
+/*
+ * Mipmap level band-limited for the fundamental a phase increment plays
+ */
+static uint32_t
+mipmap_level(float increment, SineSynth* self) {
+  float freq = increment * self->sample_rate / TWO_PI;
 
-  if (voice != NULL) {
-    voice->status = RELEASE;
-    voice->envelope_index = 0;
-    voice->released_envelope_level = voice->envelope_level;
+  if (freq <= WAVETABLE_BASE_FREQ) {
+    return 0;
   }
+
+  uint32_t level = (uint32_t)ceilf(log2f(freq / WAVETABLE_BASE_FREQ));
+
+  return level < N_MIPMAPS ? level : N_MIPMAPS - 1;
 }
 
+/*
+ * Compute modulated phase increment and output gains of a voice for the
+ * current global and voice LFO values
+ */
 static void
-deactivate_voice(uint8_t index, SineSynth* self) {
-  self->active_voices_n--;
+modulation_targets(Voice* voice, SineSynth* self,
+                   float* increment, float* left, float* right) {
+  float global_lfo = self->lfo_global_value;
+  float voice_lfo  = sin_table(voice->lfo_phase, self);
 
-  for(uint8_t i = index; i < self->active_voices_n; i++) {
-    self->active_voices_i[i] = self->active_voices_i[i+1];
+  float semitones = (*self->mod_global_pitch) * global_lfo
+                  + (*self->mod_voice_pitch)  * voice_lfo;
+
+  *increment = voice->note_increment;
+  if (semitones != 0) {
+    *increment *= exp2f(semitones / 12.0f);
+  }
+
+  voice->mipmap = mipmap_level(*increment, self);
+
+  // Tremolo swings between full level and (1 - depth)
+  float amp = self->volume_coef
+            * (1.0f - (*self->mod_global_amp) * 0.5f * (1.0f - global_lfo))
+            * (1.0f - (*self->mod_voice_amp)  * 0.5f * (1.0f - voice_lfo));
+
+  float position = (*self->panning) + voice->pan
+                 + (*self->mod_global_pan) * global_lfo
+                 + (*self->mod_voice_pan)  * voice_lfo;
+
+  if (position < -1) {
+    position = -1;
   }
+  else if (position > 1) {
+    position = 1;
+  }
+
+  pan_gains(position, left, right);
+
+  *left  *= amp;
+  *right *= amp;
 }
 
+/*
+ * Advance LFOs by one control period and set every active voice to ramp
+ * towards its new modulation targets over that period
+ */
 static void
-render_samples(uint32_t from, uint32_t to, SineSynth* self) {
-  float* const out_left  = self->out_left;
-  float* const out_right = self->out_right;
+tick_modulation(SineSynth* self) {
+  const uint32_t period = self->control_period;
 
-  for (uint32_t pos = from; pos < to; pos++) {
-    out_right[pos] = 0;
-    out_left[pos]  = 0;
+  self->lfo_global_phase = wrap_phase(self->lfo_global_phase + self->lfo_global_increment * period);
+  self->lfo_global_value = sin_table(self->lfo_global_phase, self);
 
-    for(uint8_t i_voice=0; i_voice < self->active_voices_n; i_voice++) {
-      uint8_t ai_voice = self->active_voices_i[i_voice];
-      Voice* voice = self->voices[ai_voice];
+  const float voice_advance = self->lfo_voice_increment * period;
 
-      if (voice->velocity > 0) {
-        float out = tick_voice(voice, self) * self->volume_coef;
+  for(uint8_t i_voice=0; i_voice < self->active_voices_n; i_voice++) {
+    Voice* voice = get_voice(self->active_voices_i[i_voice], self);
+    float increment, left, right;
 
-        out_right[pos] += self->pan_right * out;
-        out_left[pos]  += self->pan_left  * out;
-      }
-      else {
-        deactivate_voice(i_voice, self);
+    voice->lfo_phase = wrap_phase(voice->lfo_phase + voice_advance);
 
-        i_voice--;
-      }
-    }
+    modulation_targets(voice, self, &increment, &left, &right);
+
+    voice->phase_increment_step = (increment - voice->phase_increment) / period;
+    voice->gain_left_step       = (left  - voice->gain_left)  / period;
+    voice->gain_right_step      = (right - voice->gain_right) / period;
   }
 }
 
-/* Recalculate params every run() call to avoid calculating for each
-   sample.
-   Changing these parameters on the host will only have effect on the
-   next run() call. */
+/*
+ * Render a span of arbitrary length, used for the partial sub-blocks
+ * around events and block boundaries
+ */
 static void
-recalculate_params(SineSynth* self) {
-  self->attack_duration  = (*self->attack_time)  * self->sample_rate_ms;
-  self->hold_duration    = (*self->hold_time)    * self->sample_rate_ms;
-  self->decay_duration   = (*self->decay_time)   * self->sample_rate_ms;
-  self->release_duration = (*self->release_time) * self->sample_rate_ms;
+render_voice_span(Voice* voice, uint32_t from, uint32_t to, SineSynth* self) {
+  float* const out_left  = self->out_left;
+  float* const out_right = self->out_right;
+  const float* table_a;
+  const float* table_b;
 
-  self->volume_coef = DB_CO(*(self->volume));
+  voice_tables(voice, self, &table_a, &table_b);
+
+  for (uint32_t pos = from; pos < to; pos++) {
+    float out = tick_voice(voice, table_a, table_b, self->morph);
 
-  float angle     = (*(self->panning)) * PIOVR2 * 0.5 + PI;
-  float sin_angle = sin_table(angle, self);
-  float cos_angle = sin_table(angle + PIOVR2, self);
+    out_right[pos] += voice->gain_right * out;
+    out_left[pos]  += voice->gain_left  * out;
 
-  self->pan_left  = ROOT2OVR2 * (cos_angle - sin_angle);
-  self->pan_right = ROOT2OVR2 * (cos_angle + sin_angle);
+    voice->gain_right += voice->gain_right_step;
+    voice->gain_left  += voice->gain_left_step;
+  }
 }
 
-/* -----------------
- * LV2 Audio functions
- * See: http://lv2plug.in/doc/html/group__lv2core.html#structLV2__Descriptor
- * -----------------
+/*
+ * Render exactly N_SUB_BLOCK samples. The stateful oscillator and envelope
+ * are run into scratch buffers so the mix-down is a fixed length loop the
+ * compiler can unroll and vectorize.
  */
+static void
+render_voice_sub_block(Voice* voice, uint32_t from, SineSynth* self) {
+  float* const restrict out_left  = self->out_left  + from;
+  float* const restrict out_right = self->out_right + from;
+  float* const restrict osc = self->scratch_osc;
+  float* const restrict env = self->scratch_env;
+
+  float phase           = voice->phase;
+  float phase_increment = voice->phase_increment;
+  const float phase_increment_step = voice->phase_increment_step;
+  const float* table_a;
+  const float* table_b;
+
+  voice_tables(voice, self, &table_a, &table_b);
+
+  // Fully morphed, only table B is heard
+  if (self->morph == 1) {
+    table_a = table_b;
+  }
 
-static LV2_Handle
-instantiate(const LV2_Descriptor*     descriptor,
-            double                    rate,
-            const char*               bundle_path,
-            const LV2_Feature* const* features)
-{
-  LV2_URID_Map* map = NULL;
-  for (int i = 0; features[i]; ++i) {
-    if (!strcmp(features[i]->URI, LV2_URID__map)) {
-      map = (LV2_URID_Map*)features[i]->data;
-      break;
+  if (table_a == table_b || self->morph == 0) {
+    for (uint32_t i = 0; i < N_SUB_BLOCK; i++) {
+      osc[i] = table_lookup(table_a, phase);
+
+      phase += phase_increment;
+      if (phase >= TWO_PI) {
+        phase -= TWO_PI;
+      }
+      phase_increment += phase_increment_step;
     }
   }
+  else {
+    const float morph = self->morph;
 
-  if (!map) {
-    fprintf(stderr, "Host does not support urid:map.\n");
-    return NULL;
+    for (uint32_t i = 0; i < N_SUB_BLOCK; i++) {
+      float a = table_lookup(table_a, phase);
+      osc[i] = a + morph * (table_lookup(table_b, phase) - a);
+
+      phase += phase_increment;
+      if (phase >= TWO_PI) {
+        phase -= TWO_PI;
+      }
+      phase_increment += phase_increment_step;
+    }
   }
 
-  SineSynth* self = (SineSynth*)malloc(sizeof(SineSynth));
+  voice->phase           = phase;
+  voice->phase_increment = phase_increment;
 
-  self->map = map;
-  self->uris.midi_MidiEvent = map->map(map->handle, LV2_MIDI__MidiEvent);
-  self->sample_rate    = rate;
-  self->sample_rate_ms = rate / 1000.0;
+  if (voice->status == SUSTAIN) {
+    // Held notes spend most of their life here, the level is constant
+    for (uint32_t i = 0; i < N_SUB_BLOCK; i++) {
+      env[i] = voice->sustain_level;
+    }
+    voice->envelope_level = voice->sustain_level;
+  }
+  else {
+    for (uint32_t i = 0; i < N_SUB_BLOCK; i++) {
+      env[i] = tick_envelope(voice);
+    }
+  }
 
-  for (uint8_t i_voice = 0; i_voice < N_VOICES; i_voice++) {
-    Voice* voice = (Voice*)malloc(sizeof(Voice));
+  const float gain_left       = voice->gain_left;
+  const float gain_right      = voice->gain_right;
+  const float gain_left_step  = voice->gain_left_step;
+  const float gain_right_step = voice->gain_right_step;
 
-    voice->velocity = 0;
+  for (uint32_t i = 0; i < N_SUB_BLOCK; i++) {
+    float out = osc[i] * env[i];
 
-    self->voices[i_voice] = voice;
+    out_left[i]  += (gain_left  + gain_left_step  * i) * out;
+    out_right[i] += (gain_right + gain_right_step * i) * out;
   }
 
-  self->active_voices_n = 0;
-
-  fill_wave_table(self);
-  
-  return (LV2_Handle)self;
+  voice->gain_left  = gain_left  + gain_left_step  * N_SUB_BLOCK;
+  voice->gain_right = gain_right + gain_right_step * N_SUB_BLOCK;
 }
 
+/*
+ * Render voice over [from, to), full sub-blocks of the internal grid go
+ * through the fixed size kernel, the partial head and tail through the
+ * generic one
+ */
 static void
-connect_port(LV2_Handle instance,
-             uint32_t   port,
-             void*      data)
-{
-  SineSynth* self = (SineSynth*)instance;
+render_voice(Voice* voice, uint32_t from, uint32_t to, SineSynth* self) {
+  uint32_t head = (self->sub_block_offset + N_SUB_BLOCK - from % N_SUB_BLOCK) % N_SUB_BLOCK;
+  uint32_t pos  = from + head < to ? from + head : to;
 
-  switch ((PortIndex)port) {
-  case PORT_MIDI_IN:
-    self->control = (const LV2_Atom_Sequence*)data;
-    break;
-  case PORT_VOLUME:
-    self->volume = (const float*)data;
-    break;
-  case PORT_PANNING:
-    self->panning = (const float*)data;
-    break;
-  case PORT_ATTACK_TIME:
-    self->attack_time = (const float*)data;
-    break;
-  case PORT_HOLD_TIME:
-    self->hold_time = (const float*)data;
-    break;
-  case PORT_SUSTAIN_LEVEL:
-    self->sustain_level = (const float*)data;
-    break;
-  case PORT_DECAY_TIME:
-    self->decay_time = (const float*)data;
-    break;
-  case PORT_RELEASE_TIME:
-    self->release_time = (const float*)data;
-    break;
-  case PORT_AUDIO_OUT_LEFT:
-    self->out_left  = (float*)data;
-    break;
-  case PORT_AUDIO_OUT_RIGHT:
-    self->out_right = (float*)data;
-    break;
+  render_voice_span(voice, from, pos, self);
+
+  for (; to - pos >= N_SUB_BLOCK; pos += N_SUB_BLOCK) {
+    render_voice_sub_block(voice, pos, self);
   }
+
+  render_voice_span(voice, pos, to, self);
 }
 
 /*
- * LV2 Audio function, should not allocate resources to be Real-Time
- * capable
+ * Render voice up to frame, so that a state change applied afterwards
+ * lands on the exact sample of its event
  */
 static void
-activate(LV2_Handle instance)
-{
+sync_voice(Voice* voice, uint32_t frame, SineSynth* self) {
+  if (voice->rendered_to < frame) {
+    render_voice(voice, voice->rendered_to, frame, self);
+    voice->rendered_to = frame;
+  }
 }
 
+/*
+ * Remove finished voices from the active list
+ */
 static void
-run(LV2_Handle instance, uint32_t n_samples)
-{
-  SineSynth* self = (SineSynth*)instance;
+prune_voices(SineSynth* self) {
+  uint8_t n = 0;
 
-  recalculate_params(self);
+  for(uint8_t i_voice=0; i_voice < self->active_voices_n; i_voice++) {
+    uint8_t ai_voice = self->active_voices_i[i_voice];
 
-  uint32_t samples_done = 0;
+    if (get_voice(ai_voice, self)->velocity > 0) {
+      self->active_voices_i[n++] = ai_voice;
+    }
+  }
 
-  LV2_ATOM_SEQUENCE_FOREACH(self->control, ev) {
-    if (ev->body.type == self->uris.midi_MidiEvent) {
-      const uint8_t* const msg = (const uint8_t*)(ev + 1);
+  self->active_voices_n = n;
+}
 
-      render_samples(samples_done, ev->time.frames, self);
-      samples_done = ev->time.frames;
+/*
+ * Release the quietest voices past the governor polyphony cap, quickly
+ * but without clicking. Voices already cut short don't count.
+ */
+static void
+limit_voices(SineSynth* self) {
+  if (self->active_voices_n <= self->max_voices) {
+    return;
+  }
 
-      switch (lv2_midi_message_type(msg)) {
-      case LV2_MIDI_MSG_NOTE_ON:
-        note_on(msg[1], msg[2], self);
+  const float fast_release = GOVERNOR_RELEASE_MS * self->sample_rate_ms;
+  uint32_t n_held = 0;
 
-        break;
-      case LV2_MIDI_MSG_NOTE_OFF:
-        note_off(msg[1], self);
+  for(uint8_t i_voice=0; i_voice < self->active_voices_n; i_voice++) {
+    Voice* voice = get_voice(self->active_voices_i[i_voice], self);
 
-        break;
-      default: break;
-      }
+    if (voice->status != RELEASE || voice->release_duration > fast_release) {
+      n_held++;
     }
   }
 
-  render_samples(samples_done, n_samples, self);
-}
+  for (; n_held > self->max_voices; n_held--) {
+    Voice* quietest = NULL;
+    float quietest_level = INFINITY;
+
+    for(uint8_t i_voice=0; i_voice < self->active_voices_n; i_voice++) {
+      Voice* voice = get_voice(self->active_voices_i[i_voice], self);
+      float level = voice->envelope_level * (voice->gain_left + voice->gain_right);
+
+      if ((voice->status != RELEASE || voice->release_duration > fast_release) &&
+          level < quietest_level) {
+        quietest       = voice;
+        quietest_level = level;
+      }
+    }
+
+    quietest->status = RELEASE;
+    quietest->envelope_index = 0;
+    quietest->released_envelope_level = quietest->envelope_level;
+    quietest->release_duration = fast_release;
+  }
+}
+
+/*
+ * Get active voice assigned to note
+ */
+static Voice*
+get_active_voice(uint8_t note, SineSynth* self) {
+  for(int i_voice=0; i_voice < self->active_voices_n; i_voice++) {
+    int ai_voice = self->active_voices_i[i_voice];
+    Voice* voice = get_voice(ai_voice, self);
+
+    if (voice->note == note && voice->velocity > 0) {
+      return voice;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Activate voice and return it
+ */
+static Voice*
+activate_voice(SineSynth* self) {
+  // Voices that finished mid segment are still listed, drop them so they
+  // can't be listed twice
+  prune_voices(self);
+
+  for(int i_voice=0; i_voice < self->voice_chunks_n * N_VOICE_CHUNK; i_voice++) {
+    Voice* voice = get_voice(i_voice, self);
+
+    if (voice->velocity == 0) {
+      self->active_voices_i[self->active_voices_n++] = i_voice;
+      self->voices_stolen = 0;
+
+      if (self->active_voices_n > self->voices_peak) {
+        self->voices_peak = self->active_voices_n;
+      }
+
+      return voice;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Take over the quietest active voice when all are in use, rendered up to
+ * frame. The next activate() allocates one more voice per note stolen for.
+ */
+static Voice*
+steal_voice(uint32_t frame, SineSynth* self) {
+  Voice* quietest = NULL;
+  float quietest_level = INFINITY;
+
+  for(uint8_t i_voice=0; i_voice < self->active_voices_n; i_voice++) {
+    Voice* voice = get_voice(self->active_voices_i[i_voice], self);
+    float level = voice->envelope_level * (voice->gain_left + voice->gain_right);
+
+    if (level < quietest_level) {
+      quietest       = voice;
+      quietest_level = level;
+    }
+  }
+
+  if (quietest != NULL) {
+    sync_voice(quietest, frame, self);
+
+    if (self->voices_stolen < N_VOICES) {
+      self->voices_stolen++;
+    }
+
+    uint32_t wanted = self->active_voices_n + self->voices_stolen;
+
+    if (wanted > N_VOICES) {
+      wanted = N_VOICES;
+    }
+
+    if (wanted > self->voices_peak) {
+      self->voices_peak = wanted;
+    }
+  }
+
+  return quietest;
+}
+
+static void
+note_on(uint8_t note, uint8_t velocity, uint32_t frame, SineSynth* self) {
+  const Tuning* tuning = atomic_load_explicit(&self->tuning, memory_order_relaxed);
+
+  // Not mapped by the keyboard mapping
+  if (tuning->increments[note] == 0) {
+    return;
+  }
+
+  Voice* voice = get_active_voice(note, self);
+
+  if (voice != NULL) {
+    sync_voice(voice, frame, self);
+
+    // Its release may have ended between the last sync and this frame
+    if (voice->velocity == 0) {
+      voice = NULL;
+    }
+  }
+
+  if (voice != NULL) {
+    // Voice is in release phase, reattack from current envelope level
+    voice->status = ATTACK;
+    voice->envelope_index = voice->attack_duration * (voice->envelope_level / voice->attack_level);
+
+    return;
+  }
+
+  // Activate voice and assign note to it
+  voice = activate_voice(self);
+  float level = 0;
+
+  if (voice == NULL) {
+    // All voices in use, the quietest one continues from its phase and
+    // level so that it doesn't click
+    voice = steal_voice(frame, self);
+
+    if (voice == NULL) {
+      return;
+    }
+
+    level = voice->envelope_level;
+  }
+  else {
+    voice->phase = 0;
+  }
+
+  voice->note = note;
+  voice->velocity = velocity;
+  voice->rendered_to = frame;
+
+  voice->note_increment = tuning->increments[note];
+  voice->pan = voice_pan(note, self);
+
+  // Start from the current modulation values, the next control tick
+  // takes over the interpolation
+  voice->lfo_phase = 0;
+  modulation_targets(voice, self, &voice->phase_increment,
+                     &voice->gain_left, &voice->gain_right);
+  voice->phase_increment_step = 0;
+  voice->gain_left_step       = 0;
+  voice->gain_right_step      = 0;
+
+  voice->attack_level = 1;
+  voice->attack_duration = self->attack_duration;
+  voice->hold_duration = self->hold_duration;
+  voice->decay_duration = self->decay_duration;
+  voice->release_duration = self->release_duration;
+  voice->sustain_level = *self->sustain_level;
+
+  voice->status = ATTACK;
+  voice->envelope_index = voice->attack_duration * (level / voice->attack_level);
+  voice->envelope_level = level;
+  voice->released_envelope_level = 0;
+}
+
+static void
+note_off(uint8_t note, uint32_t frame, SineSynth* self) {
+  Voice* voice = get_active_voice(note, self);
+
+  if (voice != NULL) {
+    sync_voice(voice, frame, self);
+
+    voice->status = RELEASE;
+    voice->envelope_index = 0;
+    voice->released_envelope_level = voice->envelope_level;
+  }
+}
+
+/*
+ * Ask the worker to load a file
+ */
+static void
+request_load(WorkType type, uint32_t slot, const LV2_Atom* path, SineSynth* self) {
+  uint8_t buf[sizeof(WorkMessage) + N_MAX_PATH];
+  WorkMessage msg = { type, slot, { NULL } };
+
+  if (!self->schedule || path->size > N_MAX_PATH) {
+    return;
+  }
+
+  // Copied in, buf has no alignment for the message pointers
+  memcpy(buf, &msg, sizeof(msg));
+  memcpy(buf + sizeof(msg), LV2_ATOM_BODY_CONST(path), path->size);
+  buf[sizeof(msg) + (path->size > 0 ? path->size - 1 : 0)] = '\0';
+
+  self->schedule->schedule_work(self->schedule->handle,
+                                sizeof(WorkMessage) + (path->size > 0 ? path->size : 1), buf);
+}
+
+static void
+handle_patch(const LV2_Atom_Object* obj, SineSynth* self) {
+  if (obj->body.otype != self->uris.patch_Set) {
+    return;
+  }
+
+  const LV2_Atom* property = NULL;
+  const LV2_Atom* value    = NULL;
+
+  lv2_atom_object_get(obj,
+                      self->uris.patch_property, &property,
+                      self->uris.patch_value,    &value,
+                      0);
+
+  if (!property || property->type != self->uris.atom_URID ||
+      !value || value->type != self->uris.atom_Path) {
+    return;
+  }
+
+  LV2_URID key = ((const LV2_Atom_URID*)property)->body;
+
+  if (key == self->uris.wavetable_a) {
+    request_load(WORK_LOAD_WAVETABLE, 0, value, self);
+  }
+  else if (key == self->uris.wavetable_b) {
+    request_load(WORK_LOAD_WAVETABLE, 1, value, self);
+  }
+  else if (key == self->uris.scale) {
+    request_load(WORK_LOAD_SCALE, 0, value, self);
+  }
+  else if (key == self->uris.keymap) {
+    request_load(WORK_LOAD_KEYMAP, 0, value, self);
+  }
+}
+
+/*
+ * Pre-scan the MIDI input into the note event queue, dropping messages the
+ * synth doesn't handle. Stops when the queue is full, returns false once
+ * the whole sequence has been consumed.
+ */
+static bool
+scan_events(LV2_Atom_Event** iter, uint32_t n_samples, SineSynth* self) {
+  const LV2_Atom_Sequence* control = self->control;
+
+  self->events_n = 0;
+  self->events_i = 0;
+
+  for (; !lv2_atom_sequence_is_end(&control->body, control->atom.size, *iter);
+       *iter = lv2_atom_sequence_next(*iter)) {
+    if (self->events_n == N_EVENTS) {
+      return true;
+    }
+
+    const LV2_Atom_Event* ev = *iter;
+
+    TRACE_EVENT(self);
+
+    if (ev->body.type == self->uris.atom_Object ||
+        ev->body.type == self->uris.atom_Blank) {
+      handle_patch((const LV2_Atom_Object*)&ev->body, self);
+      continue;
+    }
+
+    if (ev->body.type != self->uris.midi_MidiEvent || ev->body.size < 3) {
+      continue;
+    }
+
+    const uint8_t* const msg = (const uint8_t*)(ev + 1);
+    uint8_t type;
+
+    switch (lv2_midi_message_type(msg)) {
+    case LV2_MIDI_MSG_NOTE_ON:
+      type = msg[2] > 0 ? LV2_MIDI_MSG_NOTE_ON : LV2_MIDI_MSG_NOTE_OFF;
+
+      break;
+    case LV2_MIDI_MSG_NOTE_OFF:
+      type = LV2_MIDI_MSG_NOTE_OFF;
+
+      break;
+    default:
+      continue;
+    }
+
+    NoteEvent* event = &self->events[self->events_n++];
+
+    // Clamp out of range timestamps, events must stay ordered
+    uint32_t frame = ev->time.frames < 0 ? 0 : (uint32_t)ev->time.frames;
+    if (frame >= n_samples) {
+      frame = n_samples > 0 ? n_samples - 1 : 0;
+    }
+    if (self->events_n > 1 && frame < event[-1].frame) {
+      frame = event[-1].frame;
+    }
+
+    event->frame    = frame;
+    event->type     = type;
+    event->note     = msg[1] & 0x7F;
+    event->velocity = msg[2] & 0x7F;
+  }
+
+  return false;
+}
+
+/*
+ * Apply queued events with frame before end, scanning further input as
+ * the queue drains
+ */
+static void
+apply_events(uint32_t end, LV2_Atom_Event** iter, bool* more_events,
+             uint32_t n_samples, SineSynth* self) {
+  for (;;) {
+    if (self->events_i == self->events_n) {
+      if (!*more_events) {
+        return;
+      }
+
+      *more_events = scan_events(iter, n_samples, self);
+      continue;
+    }
+
+    const NoteEvent* event = &self->events[self->events_i];
+
+    if (event->frame >= end) {
+      return;
+    }
+
+    if (event->type == LV2_MIDI_MSG_NOTE_ON) {
+      note_on(event->note, event->velocity, event->frame, self);
+    }
+    else {
+      note_off(event->note, event->frame, self);
+    }
+
+    self->events_i++;
+  }
+}
+
+/*
+ * Render the block in segments delimited by control ticks, modulation is
+ * evaluated once per control period and interpolated inside it.
+ *
+ * Note events don't split segments: every voice keeps track of how far it
+ * has been rendered, an event only brings the voice it touches up to its
+ * frame before changing its state. Any number of events, on the same or
+ * different frames, costs one catch-up of the affected voice each.
+ */
+static void
+render_block(uint32_t n_samples, SineSynth* self) {
+  memset(self->out_left,  0, n_samples * sizeof(float));
+  memset(self->out_right, 0, n_samples * sizeof(float));
+
+  // Control ticks fall on the sub-block grid, so the frame of the next one
+  // locates the grid inside this block
+  self->sub_block_offset = self->control_countdown % N_SUB_BLOCK;
+
+  LV2_Atom_Event* iter = lv2_atom_sequence_begin(&self->control->body);
+  bool more_events = scan_events(&iter, n_samples, self);
+
+  uint32_t pos = 0;
+
+  while (pos < n_samples) {
+    if (self->control_countdown == 0) {
+      tick_modulation(self);
+      self->control_countdown = self->control_period;
+    }
+
+    uint32_t segment_end = n_samples;
+    if (n_samples - pos > self->control_countdown) {
+      segment_end = pos + self->control_countdown;
+    }
+
+    prune_voices(self);
+
+    for(uint8_t i_voice=0; i_voice < self->active_voices_n; i_voice++) {
+      get_voice(self->active_voices_i[i_voice], self)->rendered_to = pos;
+    }
+
+    limit_voices(self);
+
+    apply_events(segment_end, &iter, &more_events, n_samples, self);
+
+    for(uint8_t i_voice=0; i_voice < self->active_voices_n; i_voice++) {
+      Voice* voice = get_voice(self->active_voices_i[i_voice], self);
+
+      if (voice->velocity > 0) {
+        sync_voice(voice, segment_end, self);
+      }
+    }
+
+    self->control_countdown -= segment_end - pos;
+    pos = segment_end;
+  }
+
+  // Only left over on empty blocks, state changes must not be lost
+  apply_events(UINT32_MAX, &iter, &more_events, n_samples, self);
+}
+
+/* Recalculate params every run() call to avoid calculating for each
+   sample.
+   Changing these parameters on the host will only have effect on the
+   next run() call. */
+static void
+recalculate_params(SineSynth* self) {
+  const GovernorLevel level = self->governor.level;
+
+  self->attack_duration  = (*self->attack_time)  * self->sample_rate_ms;
+  self->hold_duration    = (*self->hold_time)    * self->sample_rate_ms;
+  self->decay_duration   = (*self->decay_time)   * self->sample_rate_ms;
+  self->release_duration = (*self->release_time) * self->sample_rate_ms;
+
+  self->volume_coef = DB_CO(*(self->volume));
+
+  self->morph = *self->wave_morph < 0 ? 0 : (*self->wave_morph > 1 ? 1 : *self->wave_morph);
+  if (level >= GOVERNOR_NO_MORPH) {
+    self->morph = self->morph < 0.5f ? 0 : 1;
+  }
+
+  self->lfo_global_increment = (*self->lfo_global_rate) * TWO_PI / self->sample_rate;
+  self->lfo_voice_increment  = (*self->lfo_voice_rate)  * TWO_PI / self->sample_rate;
+
+  // Takes effect on the next control tick
+  float control_rate = *self->control_rate;
+  if (control_rate >= 64 || level >= GOVERNOR_CONTROL_RATE) {
+    self->control_period = 64;
+  }
+  else if (control_rate <= 16) {
+    self->control_period = 16;
+  }
+  else {
+    self->control_period = 32;
+  }
+
+  if (level >= GOVERNOR_VOICES_32) {
+    self->max_voices = 32;
+  }
+  else if (level >= GOVERNOR_VOICES_64) {
+    self->max_voices = 64;
+  }
+  else {
+    self->max_voices = N_VOICES;
+  }
+}
+
+/*
+ * Compare the time run() took to the duration of the frames it rendered
+ * and step quality down while it is above GOVERNOR_HIGH, one level per
+ * GOVERNOR_HOLD_S. Quality is only stepped back up after the load stayed
+ * below GOVERNOR_LOW for GOVERNOR_CALM_S, so it doesn't oscillate.
+ */
+static void
+update_governor(double run_time, uint32_t n_samples, SineSynth* self) {
+  Governor* governor = &self->governor;
+
+  governor->window_time   += run_time;
+  governor->window_frames += n_samples;
+
+  if (governor->window_frames >= GOVERNOR_WINDOW_S * self->sample_rate) {
+    const uint32_t frames = governor->window_frames;
+
+    float load = governor->window_time * self->sample_rate / frames;
+    float coef = 1 - expf(-(float)frames / (GOVERNOR_SMOOTHING_S * self->sample_rate));
+
+    governor->load += coef * (load - governor->load);
+    governor->window_time   = 0;
+    governor->window_frames = 0;
+
+    governor->hold = governor->hold > frames ? governor->hold - frames : 0;
+
+    if (governor->load > GOVERNOR_HIGH) {
+      governor->calm = 0;
+
+      if (governor->hold == 0 && governor->level < N_GOVERNOR_LEVELS) {
+        governor->level++;
+        governor->hold = GOVERNOR_HOLD_S * self->sample_rate;
+      }
+    }
+    else if (governor->load < GOVERNOR_LOW) {
+      governor->calm += frames;
+
+      if (governor->level > GOVERNOR_FULL && governor->calm >= GOVERNOR_CALM_S * self->sample_rate) {
+        governor->level--;
+        governor->calm = 0;
+      }
+    }
+    else {
+      governor->calm = 0;
+    }
+  }
+
+  // No deadline when rendering offline, and the result must not depend
+  // on the machine
+  if (*self->governor_enabled < 0.5f || *self->freewheel >= 0.5f) {
+    governor->level = GOVERNOR_FULL;
+    governor->hold  = 0;
+    governor->calm  = 0;
+  }
+
+  *self->dsp_load       = governor->load * 100;
+  *self->governor_level = governor->level;
+}
+
+/* -----------------
+ * LV2 Audio functions
+ * See: http://lv2plug.in/doc/html/group__lv2core.html#structLV2__Descriptor
+ * -----------------
+ */
+
+static LV2_Handle
+instantiate(const LV2_Descriptor*     descriptor,
+            double                    rate,
+            const char*               bundle_path,
+            const LV2_Feature* const* features)
+{
+  LV2_URID_Map* map = NULL;
+  LV2_Worker_Schedule* schedule = NULL;
+  for (int i = 0; features[i]; ++i) {
+    if (!strcmp(features[i]->URI, LV2_URID__map)) {
+      map = (LV2_URID_Map*)features[i]->data;
+    }
+    else if (!strcmp(features[i]->URI, LV2_WORKER__schedule)) {
+      schedule = (LV2_Worker_Schedule*)features[i]->data;
+    }
+  }
+
+  if (!map) {
+    fprintf(stderr, "Host does not support urid:map.\n");
+    return NULL;
+  }
+
+  SineSynth* self = (SineSynth*)malloc(sizeof(SineSynth));
+
+  self->map = map;
+  self->schedule = schedule;
+  self->uris.midi_MidiEvent = map->map(map->handle, LV2_MIDI__MidiEvent);
+  self->uris.atom_Blank     = map->map(map->handle, LV2_ATOM__Blank);
+  self->uris.atom_Object    = map->map(map->handle, LV2_ATOM__Object);
+  self->uris.atom_Path      = map->map(map->handle, LV2_ATOM__Path);
+  self->uris.atom_URID      = map->map(map->handle, LV2_ATOM__URID);
+  self->uris.patch_Set      = map->map(map->handle, LV2_PATCH__Set);
+  self->uris.patch_property = map->map(map->handle, LV2_PATCH__property);
+  self->uris.patch_value    = map->map(map->handle, LV2_PATCH__value);
+  self->uris.wavetable_a    = map->map(map->handle, SINE_SYNTH__wavetable_a);
+  self->uris.wavetable_b    = map->map(map->handle, SINE_SYNTH__wavetable_b);
+  self->uris.scale          = map->map(map->handle, SINE_SYNTH__scale);
+  self->uris.keymap         = map->map(map->handle, SINE_SYNTH__keymap);
+  self->sample_rate    = rate;
+  self->sample_rate_ms = rate / 1000.0;
+
+  // Voices are allocated by activate()
+  self->voice_chunks_n  = 0;
+  self->voices_peak     = 0;
+  self->voices_stolen   = 0;
+  self->active_voices_n = 0;
+  self->polyphony       = NULL;
+
+  self->control_period    = CONTROL_PERIOD_DEFAULT;
+  self->control_countdown = 0;
+  self->max_voices        = N_VOICES;
+  self->lfo_global_phase  = 0;
+  self->lfo_global_value  = 0;
+
+  self->governor.level         = GOVERNOR_FULL;
+  self->governor.window_time   = 0;
+  self->governor.window_frames = 0;
+  self->governor.load          = 0;
+  self->governor.hold          = 0;
+  self->governor.calm          = 0;
+
+  pthread_once(&shared_once, build_shared);
+
+  self->sine = &shared_sine.table;
+  self->spread_right = false;
+
+  for (uint32_t slot = 0; slot < N_WAVETABLE_SLOTS; slot++) {
+    atomic_init(&self->wavetables[slot], NULL);
+  }
+
+  atomic_init(&self->tuning, tuning_new(NULL, NULL, rate));
+  self->scale  = NULL;
+  self->keymap = NULL;
+  atomic_init(&self->worker_footprint, 0);
+
+  memset(self->paths, 0, sizeof(self->paths));
+  pthread_mutex_init(&self->files_lock, NULL);
+
+  TRACE_OPEN(self, rate);
+  
+  return (LV2_Handle)self;
+}
+
+static void
+connect_port(LV2_Handle instance,
+             uint32_t   port,
+             void*      data)
+{
+  SineSynth* self = (SineSynth*)instance;
+
+  switch ((PortIndex)port) {
+  case PORT_MIDI_IN:
+    self->control = (const LV2_Atom_Sequence*)data;
+    break;
+  case PORT_VOLUME:
+    self->volume = (const float*)data;
+    break;
+  case PORT_PANNING:
+    self->panning = (const float*)data;
+    break;
+  case PORT_ATTACK_TIME:
+    self->attack_time = (const float*)data;
+    break;
+  case PORT_HOLD_TIME:
+    self->hold_time = (const float*)data;
+    break;
+  case PORT_SUSTAIN_LEVEL:
+    self->sustain_level = (const float*)data;
+    break;
+  case PORT_DECAY_TIME:
+    self->decay_time = (const float*)data;
+    break;
+  case PORT_RELEASE_TIME:
+    self->release_time = (const float*)data;
+    break;
+  case PORT_AUDIO_OUT_LEFT:
+    self->out_left  = (float*)data;
+    break;
+  case PORT_AUDIO_OUT_RIGHT:
+    self->out_right = (float*)data;
+    break;
+  case PORT_LFO_GLOBAL_RATE:
+    self->lfo_global_rate = (const float*)data;
+    break;
+  case PORT_LFO_VOICE_RATE:
+    self->lfo_voice_rate = (const float*)data;
+    break;
+  case PORT_MOD_GLOBAL_PITCH:
+    self->mod_global_pitch = (const float*)data;
+    break;
+  case PORT_MOD_GLOBAL_AMP:
+    self->mod_global_amp = (const float*)data;
+    break;
+  case PORT_MOD_GLOBAL_PAN:
+    self->mod_global_pan = (const float*)data;
+    break;
+  case PORT_MOD_VOICE_PITCH:
+    self->mod_voice_pitch = (const float*)data;
+    break;
+  case PORT_MOD_VOICE_AMP:
+    self->mod_voice_amp = (const float*)data;
+    break;
+  case PORT_MOD_VOICE_PAN:
+    self->mod_voice_pan = (const float*)data;
+    break;
+  case PORT_CONTROL_RATE:
+    self->control_rate = (const float*)data;
+    break;
+  case PORT_WAVE_MORPH:
+    self->wave_morph = (const float*)data;
+    break;
+  case PORT_GOVERNOR:
+    self->governor_enabled = (const float*)data;
+    break;
+  case PORT_FREEWHEEL:
+    self->freewheel = (const float*)data;
+    break;
+  case PORT_GOVERNOR_LEVEL:
+    self->governor_level = (float*)data;
+    break;
+  case PORT_DSP_LOAD:
+    self->dsp_load = (float*)data;
+    break;
+  case PORT_STEREO_SPREAD:
+    self->stereo_spread = (const float*)data;
+    break;
+  case PORT_SPREAD_MODE:
+    self->spread_mode = (const float*)data;
+    break;
+  case PORT_MEMORY:
+    self->memory = (float*)data;
+    break;
+  case PORT_POLYPHONY:
+    self->polyphony = (const float*)data;
+    break;
+  }
+}
+
+/*
+ * Allocate voice chunks for the peak polyphony played so far plus
+ * VOICE_HEADROOM, and at least the polyphony port asks for. run() never
+ * allocates, notes past them steal a voice.
+ */
+static void
+activate(LV2_Handle instance)
+{
+  SineSynth* self = (SineSynth*)instance;
+  uint32_t min_voices = self->polyphony ? (uint32_t)*self->polyphony : N_VOICES;
+  uint32_t n_voices = self->voices_peak + VOICE_HEADROOM;
+  uint32_t n_chunks;
+
+  if (n_voices < min_voices) {
+    n_voices = min_voices;
+  }
+
+  n_chunks = (n_voices + N_VOICE_CHUNK - 1) / N_VOICE_CHUNK;
+
+  if (n_chunks > N_VOICE_CHUNKS) {
+    n_chunks = N_VOICE_CHUNKS;
+  }
+
+  while (self->voice_chunks_n < n_chunks) {
+    Voice* chunk = (Voice*)calloc(N_VOICE_CHUNK, sizeof(Voice));
+
+    if (!chunk) {
+      break;
+    }
+
+    self->voice_chunks[self->voice_chunks_n++] = chunk;
+  }
+
+  self->voices_stolen   = 0;
+  self->active_voices_n = 0;
+}
+
+/*
+ * Bytes held by the instance, shared tables excluded
+ */
+static uint32_t
+footprint(SineSynth* self) {
+  uint32_t bytes = sizeof(SineSynth) + sizeof(Tuning)
+                 + self->voice_chunks_n * N_VOICE_CHUNK * sizeof(Voice)
+                 + atomic_load_explicit(&self->worker_footprint, memory_order_relaxed);
+
+  for (uint32_t slot = 0; slot < N_WAVETABLE_SLOTS; slot++) {
+    const Wavetable* table = atomic_load_explicit(&self->wavetables[slot], memory_order_relaxed);
+
+    if (table) {
+      bytes += sizeof(Wavetable) + table->n_levels * sizeof(float[N_TABLE_SIZE]);
+    }
+  }
+
+  return bytes;
+}
+
+static void
+run(LV2_Handle instance, uint32_t n_samples)
+{
+  SineSynth* self = (SineSynth*)instance;
+  struct timespec start, end;
+
+  TRACE_BLOCK_BEGIN(self, n_samples);
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  recalculate_params(self);
+
+  render_block(n_samples, self);
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  update_governor((end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) * 1e-9,
+                  n_samples, self);
+
+  *self->memory = footprint(self) / 1024.0f;
+
+  TRACE_BLOCK_END(self);
+}
 
 /*
  * Free resources allocated on activate()
@@ -493,6 +1552,14 @@ run(LV2_Handle instance, uint32_t n_samples)
 static void
 deactivate(LV2_Handle instance)
 {
+  SineSynth* self = (SineSynth*)instance;
+
+  for (uint8_t i_chunk = 0; i_chunk < self->voice_chunks_n; i_chunk++) {
+    free(self->voice_chunks[i_chunk]);
+  }
+
+  self->voice_chunks_n  = 0;
+  self->active_voices_n = 0;
 }
 
 /*
@@ -503,16 +1570,323 @@ cleanup(LV2_Handle instance)
 {
   SineSynth* self = (SineSynth*)instance;
 
-  for (uint8_t i_voice = 0; i_voice < N_VOICES; i_voice++) {
-    free(self->voices[i_voice]);
+  for (uint8_t i_chunk = 0; i_chunk < self->voice_chunks_n; i_chunk++) {
+    free(self->voice_chunks[i_chunk]);
+  }
+
+  for (uint32_t slot = 0; slot < N_WAVETABLE_SLOTS; slot++) {
+    free(atomic_load(&self->wavetables[slot]));
   }
 
+  free(atomic_load(&self->tuning));
+  free(self->scale);
+  free(self->keymap);
+  pthread_mutex_destroy(&self->files_lock);
+
+  TRACE_CLOSE(self);
+
   free(self);
 }
 
+/* -----------------
+ * LV2 Worker functions, wave tables are built and freed here off the
+ * audio thread
+ * See: http://lv2plug.in/ns/ext/worker
+ * -----------------
+ */
+
+static void
+set_path(PathIndex index, const char* path, SineSynth* self) {
+  strncpy(self->paths[index], path, N_MAX_PATH - 1);
+  self->paths[index][N_MAX_PATH - 1] = '\0';
+}
+
+/*
+ * Load a Scala scale or keyboard mapping, an empty path restores the
+ * default, and build the tuning of the current pair. NULL when loading
+ * failed, nothing is replaced then. Called with files_lock held.
+ */
+static Tuning*
+load_tuning(WorkType type, const char* path, SineSynth* self) {
+  if (type == WORK_LOAD_SCALE) {
+    Scale* scale = path[0] != '\0' ? scale_load(path) : NULL;
+
+    if (path[0] != '\0' && !scale) {
+      return NULL;
+    }
+
+    free(self->scale);
+    self->scale = scale;
+    set_path(PATH_SCALE, path, self);
+  }
+  else {
+    Keymap* keymap = path[0] != '\0' ? keymap_load(path) : NULL;
+
+    if (path[0] != '\0' && !keymap) {
+      return NULL;
+    }
+
+    free(self->keymap);
+    self->keymap = keymap;
+    set_path(PATH_KEYMAP, path, self);
+  }
+
+  atomic_store_explicit(&self->worker_footprint,
+                        (self->scale  ? sizeof(Scale)  : 0) +
+                        (self->keymap ? sizeof(Keymap) : 0),
+                        memory_order_relaxed);
+
+  return tuning_new(self->scale, self->keymap, self->sample_rate);
+}
+
+static LV2_Worker_Status
+work(LV2_Handle                  instance,
+     LV2_Worker_Respond_Function respond,
+     LV2_Worker_Respond_Handle   handle,
+     uint32_t                    size,
+     const void*                 data)
+{
+  SineSynth* self = (SineSynth*)instance;
+  WorkMessage msg;
+
+  if (size < sizeof(WorkMessage)) {
+    return LV2_WORKER_ERR_UNKNOWN;
+  }
+
+  // Hosts don't align data, copy the message out before reading pointers
+  memcpy(&msg, data, sizeof(msg));
+
+  const char* path = (const char*)data + sizeof(msg);
+
+  switch (msg.type) {
+  case WORK_LOAD_WAVETABLE: {
+    WorkMessage response = { WORK_LOAD_WAVETABLE, msg.slot, { NULL } };
+
+    if (path[0] != '\0') {
+      response.table = wavetable_load(path, self->sample_rate);
+
+      if (!response.table) {
+        return LV2_WORKER_ERR_UNKNOWN;
+      }
+    }
+
+    pthread_mutex_lock(&self->files_lock);
+    set_path(PATH_WAVETABLE_A + msg.slot, path, self);
+    pthread_mutex_unlock(&self->files_lock);
+
+    return respond(handle, sizeof(response), &response);
+  }
+  case WORK_FREE_WAVETABLE:
+    free(msg.table);
+
+    return LV2_WORKER_SUCCESS;
+  case WORK_LOAD_SCALE:
+  case WORK_LOAD_KEYMAP: {
+    WorkMessage response = { msg.type, 0, { NULL } };
+
+    pthread_mutex_lock(&self->files_lock);
+    response.tuning = load_tuning(msg.type, path, self);
+    pthread_mutex_unlock(&self->files_lock);
+
+    if (!response.tuning) {
+      return LV2_WORKER_ERR_UNKNOWN;
+    }
+
+    return respond(handle, sizeof(response), &response);
+  }
+  case WORK_FREE_TUNING:
+    free(msg.tuning);
+
+    return LV2_WORKER_SUCCESS;
+  }
+
+  return LV2_WORKER_ERR_UNKNOWN;
+}
+
+/*
+ * Called in the audio thread context, swap the new table in and hand the
+ * replaced one back to the worker. Notes already playing keep their pitch
+ * on tuning changes.
+ */
+static LV2_Worker_Status
+work_response(LV2_Handle  instance,
+              uint32_t    size,
+              const void* data)
+{
+  SineSynth* self = (SineSynth*)instance;
+  WorkMessage msg;
+
+  if (size < sizeof(WorkMessage)) {
+    return LV2_WORKER_ERR_UNKNOWN;
+  }
+
+  memcpy(&msg, data, sizeof(msg));
+
+  if (msg.slot >= N_WAVETABLE_SLOTS) {
+    return LV2_WORKER_ERR_UNKNOWN;
+  }
+
+  WorkMessage release = { WORK_FREE_WAVETABLE, msg.slot, { NULL } };
+
+  switch (msg.type) {
+  case WORK_LOAD_WAVETABLE:
+    release.table = atomic_exchange(&self->wavetables[msg.slot], msg.table);
+    break;
+  case WORK_LOAD_SCALE:
+  case WORK_LOAD_KEYMAP:
+    release.type   = WORK_FREE_TUNING;
+    release.tuning = atomic_exchange(&self->tuning, msg.tuning);
+    break;
+  default:
+    return LV2_WORKER_ERR_UNKNOWN;
+  }
+
+  if (release.table) {
+    self->schedule->schedule_work(self->schedule->handle, sizeof(release), &release);
+  }
+
+  return LV2_WORKER_SUCCESS;
+}
+
+static const LV2_Worker_Interface worker = { work, work_response, NULL };
+
+/* -----------------
+ * LV2 State functions, the paths of the loaded files are saved with the
+ * session, the host saves the control ports
+ * See: http://lv2plug.in/ns/ext/state
+ * -----------------
+ */
+
+static const LV2_State_Map_Path*
+find_map_path(const LV2_Feature* const* features) {
+  for (int i = 0; features && features[i]; ++i) {
+    if (!strcmp(features[i]->URI, LV2_STATE__mapPath)) {
+      return (const LV2_State_Map_Path*)features[i]->data;
+    }
+  }
+
+  return NULL;
+}
+
+static void
+path_keys(LV2_URID keys[N_PATHS], SineSynth* self) {
+  keys[PATH_WAVETABLE_A] = self->uris.wavetable_a;
+  keys[PATH_WAVETABLE_B] = self->uris.wavetable_b;
+  keys[PATH_SCALE]       = self->uris.scale;
+  keys[PATH_KEYMAP]      = self->uris.keymap;
+}
+
+static LV2_State_Status
+save(LV2_Handle                instance,
+     LV2_State_Store_Function  store,
+     LV2_State_Handle          handle,
+     uint32_t                  flags,
+     const LV2_Feature* const* features)
+{
+  SineSynth* self = (SineSynth*)instance;
+  const LV2_State_Map_Path* map_path = find_map_path(features);
+  LV2_URID keys[N_PATHS];
+
+  if (!map_path) {
+    return LV2_STATE_ERR_NO_FEATURE;
+  }
+
+  path_keys(keys, self);
+
+  pthread_mutex_lock(&self->files_lock);
+
+  for (uint32_t i = 0; i < N_PATHS; i++) {
+    if (self->paths[i][0] == '\0') {
+      continue;
+    }
+
+    char* path = map_path->abstract_path(map_path->handle, self->paths[i]);
+
+    if (path) {
+      store(handle, keys[i], path, strlen(path) + 1, self->uris.atom_Path,
+            LV2_STATE_IS_POD | LV2_STATE_IS_PORTABLE);
+      free(path);
+    }
+  }
+
+  pthread_mutex_unlock(&self->files_lock);
+
+  return LV2_STATE_SUCCESS;
+}
+
+/*
+ * Load the saved files, those missing from the state or failing to load
+ * go back to the defaults. The host doesn't call this concurrently with
+ * run(), so tables are swapped and freed in place.
+ */
+static LV2_State_Status
+restore(LV2_Handle                  instance,
+        LV2_State_Retrieve_Function retrieve,
+        LV2_State_Handle            handle,
+        uint32_t                    flags,
+        const LV2_Feature* const*   features)
+{
+  SineSynth* self = (SineSynth*)instance;
+  const LV2_State_Map_Path* map_path = find_map_path(features);
+  LV2_URID keys[N_PATHS];
+
+  if (!map_path) {
+    return LV2_STATE_ERR_NO_FEATURE;
+  }
+
+  path_keys(keys, self);
+
+  pthread_mutex_lock(&self->files_lock);
+
+  for (uint32_t i = 0; i < N_PATHS; i++) {
+    size_t size;
+    uint32_t type, value_flags;
+    const void* value = retrieve(handle, keys[i], &size, &type, &value_flags);
+    char* path = NULL;
+
+    if (value && type == self->uris.atom_Path) {
+      path = map_path->absolute_path(map_path->handle, (const char*)value);
+    }
+
+    if (i < N_WAVETABLE_SLOTS) {
+      Wavetable* table = path ? wavetable_load(path, self->sample_rate) : NULL;
+
+      set_path(i, table ? path : "", self);
+      free(atomic_exchange(&self->wavetables[i], table));
+    }
+    else {
+      WorkType load = i == PATH_SCALE ? WORK_LOAD_SCALE : WORK_LOAD_KEYMAP;
+      Tuning* tuning = path ? load_tuning(load, path, self) : NULL;
+
+      if (!tuning) {
+        tuning = load_tuning(load, "", self);
+      }
+
+      if (tuning) {
+        free(atomic_exchange(&self->tuning, tuning));
+      }
+    }
+
+    free(path);
+  }
+
+  pthread_mutex_unlock(&self->files_lock);
+
+  return LV2_STATE_SUCCESS;
+}
+
+static const LV2_State_Interface state = { save, restore };
+
 const void*
 extension_data(const char* uri)
 {
+  if (!strcmp(uri, LV2_WORKER__interface)) {
+    return &worker;
+  }
+  else if (!strcmp(uri, LV2_STATE__interface)) {
+    return &state;
+  }
+
   return NULL;
 }
 
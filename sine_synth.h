@@ -5,9 +5,16 @@
 #include "lv2/lv2plug.in/ns/ext/atom/atom.h"
 #include "lv2/lv2plug.in/ns/ext/atom/util.h"
 #include "lv2/lv2plug.in/ns/ext/midi/midi.h"
+#include "lv2/lv2plug.in/ns/ext/patch/patch.h"
+#include "lv2/lv2plug.in/ns/ext/state/state.h"
 #include "lv2/lv2plug.in/ns/ext/urid/urid.h"
+#include "lv2/lv2plug.in/ns/ext/worker/worker.h"
 
 #define SINE_SYNTH_URI "http://bado.so/plugins/sine_synth"
+#define SINE_SYNTH__wavetable_a SINE_SYNTH_URI "#wavetable_a"
+#define SINE_SYNTH__wavetable_b SINE_SYNTH_URI "#wavetable_b"
+#define SINE_SYNTH__scale SINE_SYNTH_URI "#scale"
+#define SINE_SYNTH__keymap SINE_SYNTH_URI "#keymap"
 
 typedef enum {
   PORT_MIDI_IN = 0,
@@ -19,7 +26,25 @@ typedef enum {
   PORT_DECAY_TIME,
   PORT_RELEASE_TIME,
   PORT_AUDIO_OUT_LEFT,
-  PORT_AUDIO_OUT_RIGHT
+  PORT_AUDIO_OUT_RIGHT,
+  PORT_LFO_GLOBAL_RATE,
+  PORT_LFO_VOICE_RATE,
+  PORT_MOD_GLOBAL_PITCH,
+  PORT_MOD_GLOBAL_AMP,
+  PORT_MOD_GLOBAL_PAN,
+  PORT_MOD_VOICE_PITCH,
+  PORT_MOD_VOICE_AMP,
+  PORT_MOD_VOICE_PAN,
+  PORT_CONTROL_RATE,
+  PORT_WAVE_MORPH,
+  PORT_GOVERNOR,
+  PORT_FREEWHEEL,
+  PORT_GOVERNOR_LEVEL,
+  PORT_DSP_LOAD,
+  PORT_STEREO_SPREAD,
+  PORT_SPREAD_MODE,
+  PORT_MEMORY,
+  PORT_POLYPHONY
 } PortIndex;
 
 #endif
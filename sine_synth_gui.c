@@ -19,6 +19,10 @@
 #define FMT_GEN "%s:   %.2f"
 #define FMT_MS  "%s:   %.0f ms"
 #define FMT_DB  "%s:   %.1f dB"
+#define FMT_HZ  "%s:   %.2f Hz"
+#define FMT_ST  "%s:   %.2f st"
+#define FMT_SMP "%s:   %.0f samples"
+#define FMT_INT "%s:   %.0f"
 
 struct ControlStruct;
 
@@ -39,6 +43,19 @@ typedef struct {
   struct ControlStruct* decay;
   struct ControlStruct* sustain;
   struct ControlStruct* release;
+
+  struct ControlStruct* lfo_global_rate;
+  struct ControlStruct* lfo_voice_rate;
+  struct ControlStruct* mod_global_pitch;
+  struct ControlStruct* mod_global_amp;
+  struct ControlStruct* mod_global_pan;
+  struct ControlStruct* mod_voice_pitch;
+  struct ControlStruct* mod_voice_amp;
+  struct ControlStruct* mod_voice_pan;
+  struct ControlStruct* control_rate;
+  struct ControlStruct* wave_morph;
+  struct ControlStruct* stereo_spread;
+  struct ControlStruct* spread_mode;
 } SineSynthGui;
 
 typedef struct ControlStruct {
@@ -139,6 +156,10 @@ build_ui(SineSynthGui* gui) {
 	rtb_elem_set_layout(lower, rtb_layout_hpack_center);
 	rtb_elem_set_size_cb(lower, rtb_size_hfill);
 
+  rtb_container_t* modulation = rtb_container_new();
+	rtb_elem_set_layout(modulation, rtb_layout_hpack_center);
+	rtb_elem_set_size_cb(modulation, rtb_size_hfill);
+
   gui->monitor = rtb_label_new((rtb_utf8_t*)"Sine Synth");
 
   gui->volume = init_control("Volume", FMT_DB, PORT_VOLUME, gui);
@@ -147,6 +168,15 @@ build_ui(SineSynthGui* gui) {
   gui->panning = init_control("Panning", FMT_GEN, PORT_PANNING, gui);
   add_knob(gui->panning, -1, 1, 0, lower);
 
+  gui->stereo_spread = init_control("Stereo Spread", FMT_GEN, PORT_STEREO_SPREAD, gui);
+  add_knob(gui->stereo_spread, 0, 1, 0, lower);
+
+  gui->spread_mode = init_control("Spread Mode", FMT_INT, PORT_SPREAD_MODE, gui);
+  add_knob_i(gui->spread_mode, 0, 1, 0, lower);
+
+  gui->wave_morph = init_control("Wave Morph", FMT_GEN, PORT_WAVE_MORPH, gui);
+  add_knob(gui->wave_morph, 0, 1, 0, lower);
+
   gui->attack = init_control("Attack", FMT_MS, PORT_ATTACK_TIME, gui);
   add_knob_i(gui->attack, 1, 5000, 25, lower);
 
@@ -162,10 +192,38 @@ build_ui(SineSynthGui* gui) {
   gui->release = init_control("Release", FMT_MS, PORT_RELEASE_TIME, gui);
   add_knob_i(gui->release, 1, 5000, 100, lower);
 
+  gui->lfo_global_rate = init_control("Global LFO Rate", FMT_HZ, PORT_LFO_GLOBAL_RATE, gui);
+  add_knob(gui->lfo_global_rate, 0.01, 20, 5, modulation);
+
+  gui->mod_global_pitch = init_control("Global LFO to Pitch", FMT_ST, PORT_MOD_GLOBAL_PITCH, gui);
+  add_knob(gui->mod_global_pitch, 0, 12, 0, modulation);
+
+  gui->mod_global_amp = init_control("Global LFO to Amplitude", FMT_GEN, PORT_MOD_GLOBAL_AMP, gui);
+  add_knob(gui->mod_global_amp, 0, 1, 0, modulation);
+
+  gui->mod_global_pan = init_control("Global LFO to Pan", FMT_GEN, PORT_MOD_GLOBAL_PAN, gui);
+  add_knob(gui->mod_global_pan, 0, 1, 0, modulation);
+
+  gui->lfo_voice_rate = init_control("Voice LFO Rate", FMT_HZ, PORT_LFO_VOICE_RATE, gui);
+  add_knob(gui->lfo_voice_rate, 0.01, 20, 5, modulation);
+
+  gui->mod_voice_pitch = init_control("Voice LFO to Pitch", FMT_ST, PORT_MOD_VOICE_PITCH, gui);
+  add_knob(gui->mod_voice_pitch, 0, 12, 0, modulation);
+
+  gui->mod_voice_amp = init_control("Voice LFO to Amplitude", FMT_GEN, PORT_MOD_VOICE_AMP, gui);
+  add_knob(gui->mod_voice_amp, 0, 1, 0, modulation);
+
+  gui->mod_voice_pan = init_control("Voice LFO to Pan", FMT_GEN, PORT_MOD_VOICE_PAN, gui);
+  add_knob(gui->mod_voice_pan, 0, 1, 0, modulation);
+
+  gui->control_rate = init_control("Modulation Interval", FMT_SMP, PORT_CONTROL_RATE, gui);
+  add_knob_i(gui->control_rate, 16, 64, 32, modulation);
+
   rtb_container_add(upper, RTB_ELEMENT(gui->monitor));
 
   rtb_container_add(win, upper);
   rtb_container_add(win, lower);
+  rtb_container_add(win, modulation);
 }
 
 static void
@@ -213,7 +271,7 @@ instantiate(const struct _LV2UI_Descriptor* descriptor,
   }
 
   int width = 500;
-  int height = 100;
+  int height = 150;
 
   gui->rtb = rtb_new();
   gui->win = rtb_window_open_under(gui->rtb, (uintptr_t)x_window, width, height, "Sine Synth");
@@ -287,6 +345,42 @@ port_event(LV2UI_Handle ui,
   case PORT_RELEASE_TIME:
     control_set_value(gui->release, *pval);
     break;
+  case PORT_LFO_GLOBAL_RATE:
+    control_set_value(gui->lfo_global_rate, *pval);
+    break;
+  case PORT_LFO_VOICE_RATE:
+    control_set_value(gui->lfo_voice_rate, *pval);
+    break;
+  case PORT_MOD_GLOBAL_PITCH:
+    control_set_value(gui->mod_global_pitch, *pval);
+    break;
+  case PORT_MOD_GLOBAL_AMP:
+    control_set_value(gui->mod_global_amp, *pval);
+    break;
+  case PORT_MOD_GLOBAL_PAN:
+    control_set_value(gui->mod_global_pan, *pval);
+    break;
+  case PORT_MOD_VOICE_PITCH:
+    control_set_value(gui->mod_voice_pitch, *pval);
+    break;
+  case PORT_MOD_VOICE_AMP:
+    control_set_value(gui->mod_voice_amp, *pval);
+    break;
+  case PORT_MOD_VOICE_PAN:
+    control_set_value(gui->mod_voice_pan, *pval);
+    break;
+  case PORT_CONTROL_RATE:
+    control_set_value(gui->control_rate, *pval);
+    break;
+  case PORT_WAVE_MORPH:
+    control_set_value(gui->wave_morph, *pval);
+    break;
+  case PORT_STEREO_SPREAD:
+    control_set_value(gui->stereo_spread, *pval);
+    break;
+  case PORT_SPREAD_MODE:
+    control_set_value(gui->spread_mode, *pval);
+    break;
   default:
     break;
   }
@@ -0,0 +1,213 @@
+#ifndef SINE_SYNTH_TRACE_H
+#define SINE_SYNTH_TRACE_H
+
+/*
+ * Block tracing, compiled in with -DSINE_SYNTH_TRACE (make trace).
+ *
+ * run() pushes one record per call into a preallocated single producer,
+ * single consumer ring buffer. A helper thread drains it into a Chrome
+ * trace (chrome://tracing, Perfetto) so slow blocks can be lined up with
+ * the host timeline, timestamps are CLOCK_MONOTONIC.
+ *
+ * The file is $SINE_SYNTH_TRACE_FILE or /tmp/sine_synth_trace.<pid>.<n>.json
+ */
+
+#ifdef SINE_SYNTH_TRACE
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define N_TRACE_RECORDS (4096)
+#define TRACE_DRAIN_INTERVAL_NS (50 * 1000 * 1000)
+
+typedef struct {
+  uint64_t start_ns;
+  uint64_t duration_ns;
+  uint32_t n_samples;
+  uint32_t events;
+  uint32_t voices;
+} TraceRecord;
+
+typedef struct {
+  TraceRecord records[N_TRACE_RECORDS];
+  atomic_uint write_i;
+  atomic_uint read_i;
+  atomic_uint dropped;
+  atomic_bool running;
+
+  double sample_rate;
+  uint32_t written;
+  FILE* file;
+  pthread_t thread;
+
+  // Current block, only touched by run()
+  TraceRecord block;
+} Trace;
+
+static uint64_t
+trace_now_ns(void) {
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+
+  return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void
+trace_push(Trace* trace) {
+  unsigned write_i = atomic_load_explicit(&trace->write_i, memory_order_relaxed);
+  unsigned read_i  = atomic_load_explicit(&trace->read_i, memory_order_acquire);
+
+  if (write_i - read_i == N_TRACE_RECORDS) {
+    atomic_fetch_add_explicit(&trace->dropped, 1, memory_order_relaxed);
+    return;
+  }
+
+  trace->records[write_i % N_TRACE_RECORDS] = trace->block;
+
+  atomic_store_explicit(&trace->write_i, write_i + 1, memory_order_release);
+}
+
+/*
+ * Write pending records to the trace file, consumer side
+ */
+static void
+trace_drain(Trace* trace) {
+  unsigned read_i  = atomic_load_explicit(&trace->read_i, memory_order_relaxed);
+  unsigned write_i = atomic_load_explicit(&trace->write_i, memory_order_acquire);
+
+  for (; read_i != write_i; read_i++) {
+    const TraceRecord* r = &trace->records[read_i % N_TRACE_RECORDS];
+
+    fprintf(trace->file,
+            "%s{\"name\":\"run\",\"ph\":\"X\",\"pid\":%d,\"tid\":0,"
+            "\"ts\":%.3f,\"dur\":%.3f,\"args\":{\"n_samples\":%u,"
+            "\"events\":%u,\"voices\":%u,\"budget_us\":%.3f}}\n",
+            trace->written++ ? "," : "", (int)getpid(),
+            r->start_ns / 1000.0, r->duration_ns / 1000.0,
+            r->n_samples, r->events, r->voices,
+            r->n_samples * 1000000.0 / trace->sample_rate);
+
+    atomic_store_explicit(&trace->read_i, read_i + 1, memory_order_release);
+  }
+
+  unsigned dropped = atomic_exchange_explicit(&trace->dropped, 0, memory_order_relaxed);
+
+  if (dropped) {
+    fprintf(trace->file,
+            "%s{\"name\":\"dropped\",\"ph\":\"i\",\"s\":\"p\",\"pid\":%d,"
+            "\"tid\":0,\"ts\":%.3f,\"args\":{\"records\":%u}}\n",
+            trace->written++ ? "," : "", (int)getpid(),
+            trace_now_ns() / 1000.0, dropped);
+  }
+
+  fflush(trace->file);
+}
+
+static void*
+trace_thread(void* data) {
+  Trace* trace = (Trace*)data;
+  const struct timespec interval = { 0, TRACE_DRAIN_INTERVAL_NS };
+
+  while (atomic_load(&trace->running)) {
+    nanosleep(&interval, NULL);
+    trace_drain(trace);
+  }
+
+  return NULL;
+}
+
+static Trace*
+trace_open(double sample_rate) {
+  static atomic_uint instances;
+
+  Trace* trace = (Trace*)calloc(1, sizeof(Trace));
+  if (!trace) {
+    return NULL;
+  }
+
+  char path[256];
+  const char* env_path = getenv("SINE_SYNTH_TRACE_FILE");
+
+  if (env_path) {
+    snprintf(path, sizeof(path), "%s", env_path);
+  }
+  else {
+    snprintf(path, sizeof(path), "/tmp/sine_synth_trace.%d.%u.json",
+             (int)getpid(), atomic_fetch_add(&instances, 1));
+  }
+
+  trace->sample_rate = sample_rate;
+  trace->file = fopen(path, "w");
+
+  if (!trace->file) {
+    fprintf(stderr, "Couldn't open trace file %s\n", path);
+    free(trace);
+    return NULL;
+  }
+
+  fprintf(trace->file, "[\n");
+  atomic_store(&trace->running, true);
+
+  if (pthread_create(&trace->thread, NULL, trace_thread, trace)) {
+    fprintf(stderr, "Couldn't start trace thread\n");
+    fclose(trace->file);
+    free(trace);
+    return NULL;
+  }
+
+  return trace;
+}
+
+static void
+trace_close(Trace* trace) {
+  if (!trace) {
+    return;
+  }
+
+  atomic_store(&trace->running, false);
+  pthread_join(trace->thread, NULL);
+
+  trace_drain(trace);
+  fprintf(trace->file, "]\n");
+  fclose(trace->file);
+
+  free(trace);
+}
+
+#define TRACE_FIELD Trace* trace;
+#define TRACE_OPEN(self, rate) ((self)->trace = trace_open(rate))
+#define TRACE_CLOSE(self) trace_close((self)->trace)
+#define TRACE_BLOCK_BEGIN(self, n) do { \
+    if ((self)->trace) { \
+      (self)->trace->block.events = 0; \
+      (self)->trace->block.n_samples = (n); \
+      (self)->trace->block.voices = (self)->active_voices_n; \
+      (self)->trace->block.start_ns = trace_now_ns(); \
+    } \
+  } while (0)
+#define TRACE_EVENT(self) do { \
+    if ((self)->trace) { (self)->trace->block.events++; } \
+  } while (0)
+#define TRACE_BLOCK_END(self) do { \
+    if ((self)->trace) { \
+      (self)->trace->block.duration_ns = trace_now_ns() - (self)->trace->block.start_ns; \
+      trace_push((self)->trace); \
+    } \
+  } while (0)
+
+#else
+
+#define TRACE_FIELD
+#define TRACE_OPEN(self, rate)
+#define TRACE_CLOSE(self)
+#define TRACE_BLOCK_BEGIN(self, n)
+#define TRACE_EVENT(self)
+#define TRACE_BLOCK_END(self)
+
+#endif
+
+#endif
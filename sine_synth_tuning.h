@@ -0,0 +1,308 @@
+#ifndef SINE_SYNTH_TUNING_H
+#define SINE_SYNTH_TUNING_H
+
+/*
+ * Scala scale (.scl) and keyboard mapping (.kbm) support.
+ *
+ * Files are parsed off the audio thread into a Tuning, the phase increment
+ * of every MIDI note at the plugin sample rate, so note on is a table read.
+ * See: http://www.huygens-fokker.org/scala/scl_format.html
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N_MIDI_NOTES (128)
+#define N_MAX_SCALE_NOTES (1024)
+
+typedef struct {
+  // Zero for unmapped notes and notes at or above Nyquist, they don't sound
+  float increments[N_MIDI_NOTES];
+} Tuning;
+
+typedef struct {
+  uint32_t n_notes;
+  // Ratios of degrees 1 to n_notes to the tonic, the last is the period
+  double ratios[N_MAX_SCALE_NOTES];
+} Scale;
+
+typedef struct {
+  uint32_t map_size;
+  int first_note;
+  int last_note;
+  int middle_note;
+  int reference_note;
+  double reference_freq;
+  int octave_degree;
+  // Scale degree of each key of the map, -1 when unmapped
+  int map[N_MIDI_NOTES];
+} Keymap;
+
+/*
+ * Next line that isn't a comment, NULL at end of file
+ */
+static char*
+scala_line(char* line, int size, FILE* file) {
+  while (fgets(line, size, file)) {
+    if (line[0] != '!') {
+      return line;
+    }
+  }
+
+  return NULL;
+}
+
+/*
+ * Pitch in cents when it has a period, a ratio or an integer otherwise
+ */
+static int
+scala_pitch(const char* text, double* ratio) {
+  char* end;
+
+  while (*text == ' ' || *text == '\t') {
+    text++;
+  }
+
+  double value = strtod(text, &end);
+
+  if (end == text) {
+    return 1;
+  }
+
+  if (memchr(text, '.', end - text)) {
+    *ratio = pow(2, value / 1200);
+  }
+  else if (*end == '/') {
+    const char* denominator = end + 1;
+    double divisor = strtod(denominator, &end);
+
+    if (end == denominator || divisor <= 0) {
+      return 1;
+    }
+
+    *ratio = value / divisor;
+  }
+  else {
+    *ratio = value;
+  }
+
+  return *ratio > 0 ? 0 : 1;
+}
+
+static Scale*
+scale_load(const char* path) {
+  FILE* file = fopen(path, "r");
+
+  if (!file) {
+    fprintf(stderr, "Couldn't open %s\n", path);
+    return NULL;
+  }
+
+  Scale* scale = (Scale*)malloc(sizeof(Scale));
+  char line[256];
+  long n_notes = 0;
+
+  // Description, then note count
+  int ok = scala_line(line, sizeof(line), file) != NULL
+        && scala_line(line, sizeof(line), file) != NULL;
+
+  if (ok) {
+    n_notes = strtol(line, NULL, 10);
+    ok = n_notes > 0 && n_notes <= N_MAX_SCALE_NOTES;
+  }
+
+  for (long i = 0; ok && i < n_notes; i++) {
+    ok = scala_line(line, sizeof(line), file) != NULL
+      && !scala_pitch(line, &scale->ratios[i]);
+  }
+
+  fclose(file);
+
+  if (!ok) {
+    fprintf(stderr, "%s: invalid scale\n", path);
+    free(scale);
+    return NULL;
+  }
+
+  scale->n_notes = n_notes;
+
+  return scale;
+}
+
+static Keymap*
+keymap_load(const char* path) {
+  FILE* file = fopen(path, "r");
+
+  if (!file) {
+    fprintf(stderr, "Couldn't open %s\n", path);
+    return NULL;
+  }
+
+  Keymap* keymap = (Keymap*)malloc(sizeof(Keymap));
+  char line[256];
+  double values[7];
+  int ok = 1;
+
+  // Map size, first and last note, middle note, reference note and
+  // frequency, formal octave degree
+  for (int i = 0; ok && i < 7; i++) {
+    char* end;
+
+    ok = scala_line(line, sizeof(line), file) != NULL;
+
+    if (ok) {
+      values[i] = strtod(line, &end);
+      ok = end != line;
+    }
+  }
+
+  ok = ok && values[0] >= 0 && values[0] <= N_MIDI_NOTES && values[5] > 0;
+
+  if (ok) {
+    keymap->map_size       = values[0];
+    keymap->first_note     = values[1];
+    keymap->last_note      = values[2];
+    keymap->middle_note    = values[3];
+    keymap->reference_note = values[4];
+    keymap->reference_freq = values[5];
+    keymap->octave_degree  = values[6];
+  }
+
+  // Trailing unmapped keys may be left out
+  for (uint32_t i = 0; ok && i < keymap->map_size; i++) {
+    keymap->map[i] = i == 0 ? 0 : -1;
+
+    if (scala_line(line, sizeof(line), file)) {
+      char* text = line;
+      char* end;
+
+      while (*text == ' ' || *text == '\t') {
+        text++;
+      }
+
+      if (*text != 'x') {
+        long degree = strtol(text, &end, 10);
+        keymap->map[i] = end != text ? degree : -1;
+      }
+    }
+  }
+
+  fclose(file);
+
+  if (!ok) {
+    fprintf(stderr, "%s: invalid keyboard mapping\n", path);
+    free(keymap);
+    return NULL;
+  }
+
+  return keymap;
+}
+
+static long
+floor_div(long a, long b) {
+  return a / b - (a % b != 0 && (a < 0) != (b < 0));
+}
+
+/*
+ * Ratio of a scale degree, which may be outside the first period, to the
+ * tonic
+ */
+static double
+scale_ratio(const Scale* scale, long degree) {
+  long periods = floor_div(degree, scale->n_notes);
+  long step    = degree - periods * (long)scale->n_notes;
+
+  double ratio = pow(scale->ratios[scale->n_notes - 1], periods);
+
+  return step == 0 ? ratio : ratio * scale->ratios[step - 1];
+}
+
+/*
+ * Scale degree of a note relative to the middle note, false if unmapped
+ */
+static int
+keymap_degree(const Keymap* keymap, uint32_t n_notes, int note, long* degree) {
+  if (note < keymap->first_note || note > keymap->last_note) {
+    return 0;
+  }
+
+  long offset = note - keymap->middle_note;
+
+  // Linear mapping, every key is the next degree
+  if (keymap->map_size == 0) {
+    *degree = offset;
+    return 1;
+  }
+
+  long octaves = floor_div(offset, keymap->map_size);
+  long key     = offset - octaves * (long)keymap->map_size;
+
+  if (keymap->map[key] < 0) {
+    return 0;
+  }
+
+  long octave_degree = keymap->octave_degree > 0 ? keymap->octave_degree : (long)n_notes;
+  *degree = octaves * octave_degree + keymap->map[key];
+
+  return 1;
+}
+
+/*
+ * Phase increments of a scale and mapping, 12-TET and the standard A440
+ * mapping when either is NULL
+ */
+static Tuning*
+tuning_new(const Scale* scale, const Keymap* keymap, double sample_rate) {
+  Scale equal;
+  Keymap standard = { 0, 0, N_MIDI_NOTES - 1, 60, 69, 440.0, 12, { 0 } };
+
+  if (!scale) {
+    equal.n_notes = 12;
+    for (int i = 0; i < 12; i++) {
+      equal.ratios[i] = pow(2, (i + 1) / 12.0);
+    }
+    scale = &equal;
+  }
+
+  if (!keymap) {
+    standard.octave_degree = scale->n_notes;
+    keymap = &standard;
+  }
+
+  Tuning* tuning = (Tuning*)malloc(sizeof(Tuning));
+
+  if (!tuning) {
+    return NULL;
+  }
+
+  long reference_degree;
+  double reference_ratio = 1;
+
+  if (keymap_degree(keymap, scale->n_notes, keymap->reference_note, &reference_degree)) {
+    reference_ratio = scale_ratio(scale, reference_degree);
+  }
+
+  for (int note = 0; note < N_MIDI_NOTES; note++) {
+    long degree;
+
+    tuning->increments[note] = 0;
+
+    if (keymap_degree(keymap, scale->n_notes, note, &degree)) {
+      double freq = keymap->reference_freq * scale_ratio(scale, degree) / reference_ratio;
+      double increment = freq * 2 * 3.14159265358979323846 / sample_rate;
+
+      // Above Nyquist the note would alias, and the oscillators only wrap
+      // the phase by one period per sample
+      if (increment < 3.14159265358979323846) {
+        tuning->increments[note] = increment;
+      }
+    }
+  }
+
+  return tuning;
+}
+
+#endif
@@ -0,0 +1,308 @@
+#ifndef SINE_SYNTH_WAVETABLE_H
+#define SINE_SYNTH_WAVETABLE_H
+
+/*
+ * Mipmapped, band-limited wave tables.
+ *
+ * Level i of a table holds the waveform with only the harmonics that stay
+ * below Nyquist for fundamentals up to WAVETABLE_BASE_FREQ * 2^i. Building
+ * them from a WAV file is expensive and only done off the audio thread.
+ */
+
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define N_TABLE_SIZE (2048)
+#define N_MIPMAPS (14)
+#define N_MAX_HARMONICS (N_TABLE_SIZE / 2 - 1)
+#define N_MAX_WAV_FRAMES (65536)
+#define WAVETABLE_BASE_FREQ (8.1757989156) // MIDI note 0
+
+typedef struct {
+  uint32_t n_levels;
+  float levels[][N_TABLE_SIZE];
+} Wavetable;
+
+static Wavetable*
+wavetable_new(uint32_t n_levels) {
+  Wavetable* table = (Wavetable*)malloc(sizeof(Wavetable) + n_levels * sizeof(float[N_TABLE_SIZE]));
+
+  if (table) {
+    table->n_levels = n_levels;
+  }
+
+  return table;
+}
+
+/*
+ * Fill table, with room for one level, with a sine. It has no harmonics to
+ * band-limit.
+ */
+static void
+wavetable_sine(Wavetable* table) {
+  table->n_levels = 1;
+
+  for (int i = 0; i < N_TABLE_SIZE; i++) {
+    table->levels[0][i] = sin(i * 2 * 3.14159265358979323846 / N_TABLE_SIZE);
+  }
+}
+
+static inline const float*
+wavetable_level(const Wavetable* table, uint32_t level) {
+  return table->levels[level < table->n_levels ? level : table->n_levels - 1];
+}
+
+static uint32_t
+read_u16(const uint8_t* p) {
+  return p[0] | (p[1] << 8);
+}
+
+static uint32_t
+read_u32(const uint8_t* p) {
+  return p[0] | (p[1] << 8) | (p[2] << 16) | ((uint32_t)p[3] << 24);
+}
+
+/*
+ * Read a PCM (8, 16, 24, 32 bit) or float (32 bit) WAV file, downmixed to
+ * mono. Returns the number of frames read, 0 on error.
+ */
+static uint32_t
+wav_read(const char* path, float** samples) {
+  FILE* file = fopen(path, "rb");
+
+  if (!file) {
+    fprintf(stderr, "Couldn't open %s\n", path);
+    return 0;
+  }
+
+  fseek(file, 0, SEEK_END);
+  long size = ftell(file);
+  fseek(file, 0, SEEK_SET);
+
+  uint8_t* data = size > 12 ? (uint8_t*)malloc(size) : NULL;
+
+  if (!data || fread(data, 1, size, file) != (size_t)size) {
+    fprintf(stderr, "Couldn't read %s\n", path);
+    free(data);
+    fclose(file);
+    return 0;
+  }
+
+  fclose(file);
+
+  if (memcmp(data, "RIFF", 4) || memcmp(data + 8, "WAVE", 4)) {
+    fprintf(stderr, "%s is not a WAV file\n", path);
+    free(data);
+    return 0;
+  }
+
+  uint32_t format = 0, channels = 0, bits = 0;
+  const uint8_t* pcm = NULL;
+  uint32_t pcm_size = 0;
+
+  for (long pos = 12; pos + 8 <= size;) {
+    const uint8_t* chunk = data + pos;
+    uint32_t chunk_size = read_u32(chunk + 4);
+
+    if (chunk_size > size - pos - 8) {
+      chunk_size = size - pos - 8;
+    }
+
+    if (!memcmp(chunk, "fmt ", 4) && chunk_size >= 16) {
+      format   = read_u16(chunk + 8);
+      channels = read_u16(chunk + 10);
+      bits     = read_u16(chunk + 22);
+
+      // WAVE_FORMAT_EXTENSIBLE, the format is in the sub-format GUID
+      if (format == 0xFFFE && chunk_size >= 26) {
+        format = read_u16(chunk + 32);
+      }
+    }
+    else if (!memcmp(chunk, "data", 4)) {
+      pcm      = chunk + 8;
+      pcm_size = chunk_size;
+    }
+
+    pos += 8 + chunk_size + (chunk_size & 1);
+  }
+
+  uint32_t bytes = bits / 8;
+
+  if (!pcm || channels == 0 || !((format == 1 && bytes >= 1 && bytes <= 4) ||
+                                 (format == 3 && bytes == 4))) {
+    fprintf(stderr, "%s: unsupported WAV format\n", path);
+    free(data);
+    return 0;
+  }
+
+  uint32_t n_frames = pcm_size / (bytes * channels);
+
+  if (n_frames < 2 || n_frames > N_MAX_WAV_FRAMES) {
+    fprintf(stderr, "%s: expected a single cycle of 2 to %d frames\n", path, N_MAX_WAV_FRAMES);
+    free(data);
+    return 0;
+  }
+
+  *samples = (float*)malloc(n_frames * sizeof(float));
+
+  for (uint32_t i = 0; i < n_frames; i++) {
+    float sum = 0;
+
+    for (uint32_t c = 0; c < channels; c++) {
+      const uint8_t* p = pcm + (i * channels + c) * bytes;
+      float value;
+
+      if (format == 3) {
+        uint32_t u = read_u32(p);
+        memcpy(&value, &u, sizeof(value));
+      }
+      else if (bytes == 1) {
+        value = (p[0] - 128) / 128.0f;
+      }
+      else {
+        // Left align the sample in 32 bits so the sign is kept
+        uint32_t u = 0;
+        for (uint32_t b = 0; b < bytes; b++) {
+          u |= (uint32_t)p[b] << (8 * (4 - bytes + b));
+        }
+        value = (int32_t)u / 2147483648.0f;
+      }
+
+      sum += value;
+    }
+
+    (*samples)[i] = sum / channels;
+  }
+
+  free(data);
+
+  return n_frames;
+}
+
+/*
+ * Build the mipmapped table of a single cycle waveform: its harmonics are
+ * analyzed once, then every level is resynthesized with the harmonics it
+ * can hold at sample_rate. Levels are normalized to the peak of the
+ * fullest one.
+ */
+static Wavetable*
+wavetable_from_cycle(const float* cycle, uint32_t n_frames, double sample_rate) {
+  const double two_pi = 2 * 3.14159265358979323846;
+
+  uint32_t n_harmonics = n_frames / 2 < N_MAX_HARMONICS ? n_frames / 2 : N_MAX_HARMONICS;
+
+  double* cos_cycle = (double*)malloc(n_frames * sizeof(double));
+  double* sin_cycle = (double*)malloc(n_frames * sizeof(double));
+  float* cos_amp = (float*)calloc(n_harmonics + 1, sizeof(float));
+  float* sin_amp = (float*)calloc(n_harmonics + 1, sizeof(float));
+  float* cos_table = (float*)malloc(N_TABLE_SIZE * sizeof(float));
+  float* sin_table = (float*)malloc(N_TABLE_SIZE * sizeof(float));
+  Wavetable* table = wavetable_new(N_MIPMAPS);
+
+  if (!cos_cycle || !sin_cycle || !cos_amp || !sin_amp || !cos_table || !sin_table || !table) {
+    free(table);
+    table = NULL;
+    goto done;
+  }
+
+  for (uint32_t n = 0; n < n_frames; n++) {
+    cos_cycle[n] = cos(two_pi * n / n_frames);
+    sin_cycle[n] = sin(two_pi * n / n_frames);
+  }
+
+  for (int i = 0; i < N_TABLE_SIZE; i++) {
+    cos_table[i] = cos(two_pi * i / N_TABLE_SIZE);
+    sin_table[i] = sin(two_pi * i / N_TABLE_SIZE);
+  }
+
+  // Analysis, DC is dropped
+  for (uint32_t k = 1; k <= n_harmonics; k++) {
+    double re = 0, im = 0;
+    uint32_t index = 0;
+
+    for (uint32_t n = 0; n < n_frames; n++) {
+      re += cycle[n] * cos_cycle[index];
+      im += cycle[n] * sin_cycle[index];
+
+      index += k;
+      if (index >= n_frames) {
+        index -= n_frames;
+      }
+    }
+
+    cos_amp[k] = 2 * re / n_frames;
+    sin_amp[k] = 2 * im / n_frames;
+  }
+
+  for (uint32_t level = 0; level < N_MIPMAPS; level++) {
+    double top_freq = WAVETABLE_BASE_FREQ * (1 << level);
+    uint32_t level_harmonics = (uint32_t)(sample_rate * 0.5 / top_freq);
+
+    if (level_harmonics > n_harmonics) {
+      level_harmonics = n_harmonics;
+    }
+    if (level_harmonics < 1) {
+      level_harmonics = 1;
+    }
+
+    float* out = table->levels[level];
+
+    for (int i = 0; i < N_TABLE_SIZE; i++) {
+      float sum = 0;
+
+      for (uint32_t k = 1; k <= level_harmonics; k++) {
+        uint32_t index = (k * i) & (N_TABLE_SIZE - 1);
+
+        sum += cos_amp[k] * cos_table[index] + sin_amp[k] * sin_table[index];
+      }
+
+      out[i] = sum;
+    }
+  }
+
+  float peak = 0;
+
+  for (int i = 0; i < N_TABLE_SIZE; i++) {
+    float value = fabsf(table->levels[0][i]);
+    peak = value > peak ? value : peak;
+  }
+
+  if (peak > 0) {
+    for (uint32_t level = 0; level < N_MIPMAPS; level++) {
+      for (int i = 0; i < N_TABLE_SIZE; i++) {
+        table->levels[level][i] /= peak;
+      }
+    }
+  }
+
+done:
+  free(cos_cycle);
+  free(sin_cycle);
+  free(cos_amp);
+  free(sin_amp);
+  free(cos_table);
+  free(sin_table);
+
+  return table;
+}
+
+static Wavetable*
+wavetable_load(const char* path, double sample_rate) {
+  float* cycle = NULL;
+  uint32_t n_frames = wav_read(path, &cycle);
+
+  if (n_frames == 0) {
+    return NULL;
+  }
+
+  Wavetable* table = wavetable_from_cycle(cycle, n_frames, sample_rate);
+
+  free(cycle);
+
+  return table;
+}
+
+#endif
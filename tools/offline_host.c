@@ -0,0 +1,647 @@
+/*
+ * Headless LV2 host running Sine Synth through scripted MIDI workloads.
+ *
+ * Used to train profile guided builds (make pgo) and to exercise the
+ * plugin without audio hardware.
+ *
+ * Usage: offline_host [-o output.raw] plugin.so workload...
+ *
+ * Workload files are line based, '#' starts a comment:
+ *
+ *   rate <hz>                          sample rate, default 48000
+ *   length <frames>                    frames to render
+ *   block <frames> [max]               host buffer size, random in
+ *                                      [frames, max] when max is given
+ *   set <symbol> <value>               control port value
+ *   note <frame> <note> <vel> <len>    single note
+ *   chord <frame> <low> <high> <vel> <len>
+ *                                      every note in [low, high]
+ *   storm <frame> <len> <count> <seed> pseudo random notes over len frames
+ *   wavetable <frame> <a|b> <path>     load a WAV into a wave table slot,
+ *                                      relative to the workload file
+ *   scale <frame> <path>               load a Scala scale (.scl)
+ *   keymap <frame> <path>              load a Scala keyboard mapping (.kbm)
+ *
+ * Worker requests are run between run() calls, as a worker thread would.
+ * Rendering is offline, so freewheel is on and the CPU governor doesn't
+ * make output depend on machine speed. Workloads exercising the governor
+ * set freewheel to 0.
+ *
+ * When tools/rtcheck.so is preloaded, run() and work_response() calls are
+ * reported to it so it can trap non realtime safe calls inside them.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <libgen.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "../sine_synth.h"
+
+#define MAX_BLOCK (8192)
+#define MAX_URIS (64)
+#define SEQUENCE_SIZE (65536)
+#define MAX_WORK (64)
+#define MAX_WORK_SIZE (2048)
+
+typedef struct {
+  PortIndex port;
+  const char* symbol;
+  float default_value;
+  float value;
+} ControlPort;
+
+static ControlPort controls[] = {
+  { PORT_VOLUME,           "volume",           -15, 0 },
+  { PORT_PANNING,          "panning",          0, 0 },
+  { PORT_ATTACK_TIME,      "attack_time",      25, 0 },
+  { PORT_HOLD_TIME,        "hold_time",        0, 0 },
+  { PORT_SUSTAIN_LEVEL,    "sustain_level",    0.7, 0 },
+  { PORT_DECAY_TIME,       "decay_time",       25, 0 },
+  { PORT_RELEASE_TIME,     "release_time",     100, 0 },
+  { PORT_LFO_GLOBAL_RATE,  "lfo_global_rate",  5, 0 },
+  { PORT_LFO_VOICE_RATE,   "lfo_voice_rate",   5, 0 },
+  { PORT_MOD_GLOBAL_PITCH, "mod_global_pitch", 0, 0 },
+  { PORT_MOD_GLOBAL_AMP,   "mod_global_amp",   0, 0 },
+  { PORT_MOD_GLOBAL_PAN,   "mod_global_pan",   0, 0 },
+  { PORT_MOD_VOICE_PITCH,  "mod_voice_pitch",  0, 0 },
+  { PORT_MOD_VOICE_AMP,    "mod_voice_amp",    0, 0 },
+  { PORT_MOD_VOICE_PAN,    "mod_voice_pan",    0, 0 },
+  { PORT_CONTROL_RATE,     "control_rate",     32, 0 },
+  { PORT_WAVE_MORPH,       "wave_morph",       0, 0 },
+  { PORT_GOVERNOR,         "governor",         1, 0 },
+  { PORT_FREEWHEEL,        "freewheel",        1, 0 },
+  { PORT_GOVERNOR_LEVEL,   "governor_level",   0, 0 },
+  { PORT_DSP_LOAD,         "dsp_load",         0, 0 },
+  { PORT_STEREO_SPREAD,    "stereo_spread",    0, 0 },
+  { PORT_SPREAD_MODE,      "spread_mode",      0, 0 },
+  { PORT_MEMORY,           "memory",           0, 0 },
+  { PORT_POLYPHONY,        "polyphony",        128, 0 },
+};
+
+#define N_CONTROLS (sizeof(controls) / sizeof(controls[0]))
+
+typedef struct {
+  uint64_t frame;
+  uint32_t order;
+  uint8_t msg[3];
+
+  // patch:Set of a path parameter instead of MIDI when set
+  const char* property;
+  char* path;
+} Event;
+
+typedef struct {
+  uint32_t size;
+  uint8_t data[MAX_WORK_SIZE] __attribute__((aligned(8)));
+} WorkItem;
+
+typedef struct {
+  WorkItem items[MAX_WORK];
+  uint32_t n;
+} WorkQueue;
+
+static WorkQueue work_requests;
+static WorkQueue work_responses;
+
+static void (*rtcheck_enter)(void);
+static void (*rtcheck_leave)(void);
+
+static void
+audio_enter(void) {
+  if (rtcheck_enter) {
+    rtcheck_enter();
+  }
+}
+
+static void
+audio_leave(void) {
+  if (rtcheck_leave) {
+    rtcheck_leave();
+  }
+}
+
+typedef struct {
+  double rate;
+  uint64_t length;
+  uint32_t block_min;
+  uint32_t block_max;
+
+  Event* events;
+  uint32_t events_n;
+  uint32_t events_cap;
+} Workload;
+
+static char* uris[MAX_URIS];
+static uint32_t uris_n = 0;
+
+static LV2_URID
+map_uri(LV2_URID_Map_Handle handle, const char* uri) {
+  for (uint32_t i = 0; i < uris_n; i++) {
+    if (!strcmp(uris[i], uri)) {
+      return i + 1;
+    }
+  }
+
+  if (uris_n == MAX_URIS) {
+    fprintf(stderr, "Too many URIs mapped.\n");
+    exit(1);
+  }
+
+  uris[uris_n++] = strdup(uri);
+
+  return uris_n;
+}
+
+static void
+add_event(Workload* w, uint64_t frame, uint8_t status, uint8_t note, uint8_t velocity) {
+  if (w->events_n == w->events_cap) {
+    w->events_cap = w->events_cap ? w->events_cap * 2 : 1024;
+    w->events = realloc(w->events, w->events_cap * sizeof(Event));
+  }
+
+  Event* ev = &w->events[w->events_n];
+
+  ev->frame    = frame;
+  ev->order    = w->events_n++;
+  ev->msg[0]   = status;
+  ev->msg[1]   = note & 0x7F;
+  ev->msg[2]   = velocity & 0x7F;
+  ev->property = NULL;
+  ev->path     = NULL;
+}
+
+static void
+add_path_event(Workload* w, uint64_t frame, const char* property,
+               const char* dir, const char* file) {
+  char* path = malloc(strlen(dir) + strlen(file) + 2);
+  sprintf(path, "%s/%s", dir, file);
+
+  add_event(w, frame, 0, 0, 0);
+
+  w->events[w->events_n - 1].property = property;
+  w->events[w->events_n - 1].path     = path;
+}
+
+static LV2_Worker_Status
+queue_work(WorkQueue* queue, uint32_t size, const void* data) {
+  if (queue->n == MAX_WORK || size > MAX_WORK_SIZE) {
+    return LV2_WORKER_ERR_NO_SPACE;
+  }
+
+  queue->items[queue->n].size = size;
+  memcpy(queue->items[queue->n].data, data, size);
+  queue->n++;
+
+  return LV2_WORKER_SUCCESS;
+}
+
+static LV2_Worker_Status
+schedule_work(LV2_Worker_Schedule_Handle handle, uint32_t size, const void* data) {
+  return queue_work(&work_requests, size, data);
+}
+
+static LV2_Worker_Status
+respond(LV2_Worker_Respond_Handle handle, uint32_t size, const void* data) {
+  return queue_work(&work_responses, size, data);
+}
+
+/*
+ * Deliver responses to the plugin then run the requests, including the
+ * ones the responses scheduled
+ */
+static void
+run_worker(const LV2_Worker_Interface* worker, LV2_Handle instance) {
+  for (uint32_t i = 0; i < work_responses.n; i++) {
+    audio_enter();
+    worker->work_response(instance, work_responses.items[i].size, work_responses.items[i].data);
+    audio_leave();
+  }
+  work_responses.n = 0;
+
+  for (uint32_t i = 0; i < work_requests.n; i++) {
+    if (worker->work(instance, respond, NULL, work_requests.items[i].size,
+                     work_requests.items[i].data)) {
+      fprintf(stderr, "Worker request failed\n");
+    }
+  }
+  work_requests.n = 0;
+}
+
+/*
+ * Append an atom:Object patch:Set of a path parameter to the sequence
+ */
+static void
+write_patch_set(LV2_Atom_Event* ev, const char* property, const char* path) {
+  LV2_Atom_Object* obj = (LV2_Atom_Object*)&ev->body;
+  uint32_t path_size = strlen(path) + 1;
+
+  obj->atom.type   = map_uri(NULL, LV2_ATOM__Object);
+  obj->body.id     = 0;
+  obj->body.otype  = map_uri(NULL, LV2_PATCH__Set);
+
+  LV2_Atom_Property_Body* key = (LV2_Atom_Property_Body*)(obj + 1);
+  key->key        = map_uri(NULL, LV2_PATCH__property);
+  key->context    = 0;
+  key->value.type = map_uri(NULL, LV2_ATOM__URID);
+  key->value.size = sizeof(uint32_t);
+  *(uint32_t*)(key + 1) = map_uri(NULL, property);
+
+  LV2_Atom_Property_Body* value = (LV2_Atom_Property_Body*)
+    ((uint8_t*)key + lv2_atom_pad_size(sizeof(*key) + sizeof(uint32_t)));
+  value->key        = map_uri(NULL, LV2_PATCH__value);
+  value->context    = 0;
+  value->value.type = map_uri(NULL, LV2_ATOM__Path);
+  value->value.size = path_size;
+  memcpy(value + 1, path, path_size);
+
+  obj->atom.size = sizeof(LV2_Atom_Object_Body)
+    + lv2_atom_pad_size(sizeof(*key) + sizeof(uint32_t))
+    + lv2_atom_pad_size(sizeof(*value) + path_size);
+}
+
+static void
+add_note(Workload* w, uint64_t frame, int note, int velocity, uint64_t length) {
+  add_event(w, frame, 0x90, note, velocity);
+  add_event(w, frame + length, 0x80, note, 0);
+}
+
+static int
+compare_events(const void* a, const void* b) {
+  const Event* ea = (const Event*)a;
+  const Event* eb = (const Event*)b;
+
+  if (ea->frame != eb->frame) {
+    return ea->frame < eb->frame ? -1 : 1;
+  }
+
+  return ea->order < eb->order ? -1 : 1;
+}
+
+static ControlPort*
+find_control(const char* symbol) {
+  for (uint32_t i = 0; i < N_CONTROLS; i++) {
+    if (!strcmp(controls[i].symbol, symbol)) {
+      return &controls[i];
+    }
+  }
+
+  return NULL;
+}
+
+static int
+set_control(const char* symbol, float value) {
+  ControlPort* control = find_control(symbol);
+
+  if (!control) {
+    return 1;
+  }
+
+  control->value = value;
+
+  return 0;
+}
+
+static int
+load_workload(const char* path, Workload* w) {
+  FILE* input = fopen(path, "r");
+
+  if (!input) {
+    fprintf(stderr, "Couldn't open workload %s\n", path);
+    return 1;
+  }
+
+  char line[1024];
+  int line_n = 0;
+
+  char* dir_buf = strdup(path);
+  const char* dir = dirname(dir_buf);
+
+  // Every workload starts from the plugin defaults
+  for (uint32_t i = 0; i < N_CONTROLS; i++) {
+    controls[i].value = controls[i].default_value;
+  }
+
+  while (fgets(line, sizeof(line), input)) {
+    char cmd[32], symbol[64], file[768];
+    unsigned long long frame, length;
+    int a, b, c;
+    float value;
+
+    line_n++;
+
+    char* comment = strchr(line, '#');
+    if (comment) {
+      *comment = '\0';
+    }
+
+    if (sscanf(line, "%31s", cmd) != 1) {
+      continue;
+    }
+
+    int ok = 0;
+
+    if (!strcmp(cmd, "rate")) {
+      ok = sscanf(line, "%*s %lf", &w->rate) == 1;
+    }
+    else if (!strcmp(cmd, "length")) {
+      ok = sscanf(line, "%*s %llu", &length) == 1;
+      w->length = length;
+    }
+    else if (!strcmp(cmd, "block")) {
+      int n = sscanf(line, "%*s %d %d", &a, &b);
+      ok = n >= 1 && a > 0 && a <= MAX_BLOCK && (n == 1 || (b >= a && b <= MAX_BLOCK));
+      w->block_min = a;
+      w->block_max = n == 2 ? b : a;
+    }
+    else if (!strcmp(cmd, "set")) {
+      ok = sscanf(line, "%*s %63s %f", symbol, &value) == 2
+        && !set_control(symbol, value);
+    }
+    else if (!strcmp(cmd, "note")) {
+      ok = sscanf(line, "%*s %llu %d %d %llu", &frame, &a, &b, &length) == 4;
+      add_note(w, frame, a, b, length);
+    }
+    else if (!strcmp(cmd, "chord")) {
+      ok = sscanf(line, "%*s %llu %d %d %d %llu", &frame, &a, &b, &c, &length) == 5;
+      for (int note = a; ok && note <= b; note++) {
+        add_note(w, frame, note, c, length);
+      }
+    }
+    else if (!strcmp(cmd, "storm")) {
+      unsigned long long count;
+      unsigned int seed;
+
+      ok = sscanf(line, "%*s %llu %llu %llu %u", &frame, &length, &count, &seed) == 4
+        && length > 0;
+
+      for (unsigned long long i = 0; ok && i < count; i++) {
+        seed = seed * 1103515245 + 12345;
+        uint64_t at = frame + (seed >> 8) % length;
+        seed = seed * 1103515245 + 12345;
+        int note = 24 + (seed >> 8) % 84;
+        seed = seed * 1103515245 + 12345;
+        uint64_t len = 1 + (seed >> 8) % (length / 4 + 1);
+
+        add_note(w, at, note, 32 + note % 96, len);
+      }
+    }
+
+    else if (!strcmp(cmd, "wavetable")) {
+      ok = sscanf(line, "%*s %llu %63s %767s", &frame, symbol, file) == 3
+        && (!strcmp(symbol, "a") || !strcmp(symbol, "b"));
+
+      if (ok) {
+        add_path_event(w, frame, symbol[0] == 'a' ? SINE_SYNTH__wavetable_a
+                                                  : SINE_SYNTH__wavetable_b, dir, file);
+      }
+    }
+    else if (!strcmp(cmd, "scale") || !strcmp(cmd, "keymap")) {
+      ok = sscanf(line, "%*s %llu %767s", &frame, file) == 2;
+
+      if (ok) {
+        add_path_event(w, frame, cmd[0] == 's' ? SINE_SYNTH__scale
+                                               : SINE_SYNTH__keymap, dir, file);
+      }
+    }
+
+    if (!ok) {
+      fprintf(stderr, "%s:%d: invalid line\n", path, line_n);
+      fclose(input);
+      free(dir_buf);
+      return 1;
+    }
+  }
+
+  fclose(input);
+  free(dir_buf);
+
+  qsort(w->events, w->events_n, sizeof(Event), compare_events);
+
+  return 0;
+}
+
+static double
+elapsed(const struct timespec* from, const struct timespec* to) {
+  return (to->tv_sec - from->tv_sec) + (to->tv_nsec - from->tv_nsec) * 1e-9;
+}
+
+static int
+run_workload(const LV2_Descriptor* descriptor, const char* path, FILE* output) {
+  Workload w = { 48000, 48000, 256, 256, NULL, 0, 0 };
+
+  if (load_workload(path, &w)) {
+    return 1;
+  }
+
+  LV2_URID_Map map = { NULL, map_uri };
+  LV2_Feature map_feature = { LV2_URID__map, &map };
+  LV2_Worker_Schedule schedule = { NULL, schedule_work };
+  LV2_Feature schedule_feature = { LV2_WORKER__schedule, &schedule };
+  const LV2_Feature* features[] = { &map_feature, &schedule_feature, NULL };
+
+  const LV2_Worker_Interface* worker = (const LV2_Worker_Interface*)
+    descriptor->extension_data(LV2_WORKER__interface);
+
+  LV2_Handle instance = descriptor->instantiate(descriptor, w.rate, ".", features);
+
+  if (!instance) {
+    fprintf(stderr, "Couldn't instantiate plugin\n");
+    return 1;
+  }
+
+  static float out_left[MAX_BLOCK];
+  static float out_right[MAX_BLOCK];
+  static uint64_t sequence_buf[SEQUENCE_SIZE / sizeof(uint64_t)];
+  LV2_Atom_Sequence* sequence = (LV2_Atom_Sequence*)sequence_buf;
+
+  LV2_URID midi_MidiEvent = map_uri(NULL, LV2_MIDI__MidiEvent);
+
+  descriptor->connect_port(instance, PORT_MIDI_IN, sequence);
+  descriptor->connect_port(instance, PORT_AUDIO_OUT_LEFT, out_left);
+  descriptor->connect_port(instance, PORT_AUDIO_OUT_RIGHT, out_right);
+
+  for (uint32_t i = 0; i < N_CONTROLS; i++) {
+    descriptor->connect_port(instance, controls[i].port, &controls[i].value);
+  }
+
+  descriptor->activate(instance);
+
+  struct timespec start, end;
+  double run_time = 0;
+  uint64_t done = 0, blocks = 0;
+  uint32_t i_event = 0, seed = 1;
+  float peak = 0;
+  float governor_max = 0, memory_max = 0;
+  const ControlPort* governor_level = find_control("governor_level");
+  const ControlPort* memory = find_control("memory");
+
+  while (done < w.length) {
+    uint32_t n_samples = w.block_min;
+
+    if (w.block_max > w.block_min) {
+      seed = seed * 1103515245 + 12345;
+      n_samples += (seed >> 8) % (w.block_max - w.block_min + 1);
+    }
+    if (n_samples > w.length - done) {
+      n_samples = w.length - done;
+    }
+
+    sequence->atom.type = map_uri(NULL, LV2_ATOM__Sequence);
+    sequence->atom.size = sizeof(LV2_Atom_Sequence_Body);
+    sequence->body.unit = 0;
+    sequence->body.pad  = 0;
+
+    for (; i_event < w.events_n && w.events[i_event].frame < done + n_samples; i_event++) {
+      const Event* event = &w.events[i_event];
+      uint32_t ev_size = sizeof(LV2_Atom_Event) + lv2_atom_pad_size(3);
+
+      if (event->path) {
+        ev_size = sizeof(LV2_Atom_Event) + sizeof(LV2_Atom_Object_Body)
+          + 2 * sizeof(LV2_Atom_Property_Body) + 8 + lv2_atom_pad_size(strlen(event->path) + 1);
+      }
+
+      if (sequence->atom.size + sizeof(LV2_Atom) + ev_size > SEQUENCE_SIZE) {
+        fprintf(stderr, "Too many events in one block, dropping\n");
+        continue;
+      }
+
+      LV2_Atom_Event* ev = (LV2_Atom_Event*)
+        ((uint8_t*)&sequence->body + sequence->atom.size);
+
+      ev->time.frames = event->frame - done;
+
+      if (event->path) {
+        write_patch_set(ev, event->property, event->path);
+      }
+      else {
+        ev->body.type = midi_MidiEvent;
+        ev->body.size = 3;
+        memcpy(ev + 1, event->msg, 3);
+      }
+
+      sequence->atom.size += ev_size;
+    }
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    audio_enter();
+    descriptor->run(instance, n_samples);
+    audio_leave();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    run_time += elapsed(&start, &end);
+
+    if (governor_level->value > governor_max) {
+      governor_max = governor_level->value;
+    }
+    if (memory->value > memory_max) {
+      memory_max = memory->value;
+    }
+
+    if (worker) {
+      run_worker(worker, instance);
+    }
+
+    for (uint32_t i = 0; i < n_samples; i++) {
+      float l = out_left[i] < 0 ? -out_left[i] : out_left[i];
+      float r = out_right[i] < 0 ? -out_right[i] : out_right[i];
+
+      peak = l > peak ? l : peak;
+      peak = r > peak ? r : peak;
+
+      if (output) {
+        float frame[2] = { out_left[i], out_right[i] };
+        fwrite(frame, sizeof(float), 2, output);
+      }
+    }
+
+    done += n_samples;
+    blocks++;
+  }
+
+  descriptor->deactivate(instance);
+
+  if (worker) {
+    // Let the plugin hand back tables it replaced last
+    run_worker(worker, instance);
+    run_worker(worker, instance);
+  }
+
+  descriptor->cleanup(instance);
+
+  printf("%s: %llu frames, %llu blocks, %u events, peak %.3f, "
+         "run %.3f ms (%.2f%% of real time), memory %.1f KiB\n",
+         path, (unsigned long long)w.length, (unsigned long long)blocks,
+         w.events_n, peak, run_time * 1000,
+         100 * run_time / (w.length / w.rate), memory_max);
+
+  if (governor_max > 0) {
+    printf("%s: quality reduced by the governor, down to level %.0f\n", path, governor_max);
+  }
+
+  for (uint32_t i = 0; i < w.events_n; i++) {
+    free(w.events[i].path);
+  }
+  free(w.events);
+
+  return 0;
+}
+
+int
+main(int argc, char** argv) {
+  const char* output_path = NULL;
+  int arg = 1;
+
+  if (arg + 1 < argc && !strcmp(argv[arg], "-o")) {
+    output_path = argv[arg + 1];
+    arg += 2;
+  }
+
+  rtcheck_enter = (void (*)(void))dlsym(RTLD_DEFAULT, "rtcheck_enter");
+  rtcheck_leave = (void (*)(void))dlsym(RTLD_DEFAULT, "rtcheck_leave");
+
+  if (argc - arg < 2) {
+    fprintf(stderr, "Usage: %s [-o output.raw] plugin.so workload...\n", argv[0]);
+    return 1;
+  }
+
+  void* lib = dlopen(argv[arg], RTLD_NOW);
+
+  if (!lib) {
+    fprintf(stderr, "%s\n", dlerror());
+    return 1;
+  }
+
+  LV2_Descriptor_Function descriptor_function =
+    (LV2_Descriptor_Function)dlsym(lib, "lv2_descriptor");
+  const LV2_Descriptor* descriptor =
+    descriptor_function ? descriptor_function(0) : NULL;
+
+  if (!descriptor) {
+    fprintf(stderr, "No plugin descriptor in %s\n", argv[arg]);
+    return 1;
+  }
+
+  FILE* output = NULL;
+
+  if (output_path && !(output = fopen(output_path, "wb"))) {
+    fprintf(stderr, "Couldn't open %s\n", output_path);
+    return 1;
+  }
+
+  int status = 0;
+
+  for (arg++; arg < argc && !status; arg++) {
+    status = run_workload(descriptor, argv[arg], output);
+  }
+
+  if (output) {
+    fclose(output);
+  }
+
+  dlclose(lib);
+
+  return status;
+}
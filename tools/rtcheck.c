@@ -0,0 +1,414 @@
+/*
+ * Realtime safety checker, preloaded into the offline host (make rtcheck).
+ *
+ * Interposes memory allocation, locking, sleeping, file and stdio calls,
+ * and aborts with a backtrace if any of them is made while the calling
+ * thread is inside the plugin's audio functions. The host brackets run()
+ * and work_response() with rtcheck_enter() and rtcheck_leave(), looked up
+ * at runtime so it doesn't depend on this library.
+ *
+ * The _chk variants are what printf and friends compile to with
+ * _FORTIFY_SOURCE, enabled by default on several distributions.
+ */
+#define _GNU_SOURCE
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <malloc.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+extern void* __libc_malloc(size_t size);
+extern void* __libc_calloc(size_t n, size_t size);
+extern void* __libc_realloc(void* ptr, size_t size);
+extern void  __libc_free(void* ptr);
+
+// Fortified stdio, only declared by glibc when _FORTIFY_SOURCE is on
+extern int __printf_chk(int flag, const char* format, ...);
+extern int __fprintf_chk(FILE* stream, int flag, const char* format, ...);
+extern int __vfprintf_chk(FILE* stream, int flag, const char* format, va_list args);
+
+static __thread int in_audio;
+static unsigned long checked_calls;
+
+#define NEXT(name) static __typeof__(name)* next_##name
+#define RESOLVE(name) next_##name = (__typeof__(name)*)dlsym(RTLD_NEXT, #name)
+
+NEXT(posix_memalign);
+NEXT(aligned_alloc);
+NEXT(memalign);
+NEXT(valloc);
+NEXT(pthread_mutex_lock);
+NEXT(pthread_mutex_trylock);
+NEXT(pthread_cond_wait);
+NEXT(pthread_cond_timedwait);
+NEXT(pthread_rwlock_rdlock);
+NEXT(pthread_rwlock_wrlock);
+NEXT(pthread_rwlock_tryrdlock);
+NEXT(pthread_rwlock_trywrlock);
+NEXT(pthread_rwlock_timedrdlock);
+NEXT(pthread_rwlock_timedwrlock);
+NEXT(sem_wait);
+NEXT(sem_timedwait);
+NEXT(nanosleep);
+NEXT(clock_nanosleep);
+NEXT(usleep);
+NEXT(sleep);
+NEXT(mmap);
+NEXT(munmap);
+NEXT(open);
+NEXT(open64);
+NEXT(openat);
+NEXT(close);
+NEXT(read);
+NEXT(write);
+NEXT(fopen);
+NEXT(fopen64);
+NEXT(fclose);
+NEXT(fread);
+NEXT(fwrite);
+NEXT(fflush);
+NEXT(fputs);
+NEXT(puts);
+NEXT(vfprintf);
+NEXT(__vfprintf_chk);
+
+__attribute__((constructor))
+static void
+rtcheck_init(void) {
+  RESOLVE(posix_memalign);
+  RESOLVE(aligned_alloc);
+  RESOLVE(memalign);
+  RESOLVE(valloc);
+  RESOLVE(pthread_mutex_lock);
+  RESOLVE(pthread_mutex_trylock);
+  RESOLVE(pthread_cond_wait);
+  RESOLVE(pthread_cond_timedwait);
+  RESOLVE(pthread_rwlock_rdlock);
+  RESOLVE(pthread_rwlock_wrlock);
+  RESOLVE(pthread_rwlock_tryrdlock);
+  RESOLVE(pthread_rwlock_trywrlock);
+  RESOLVE(pthread_rwlock_timedrdlock);
+  RESOLVE(pthread_rwlock_timedwrlock);
+  RESOLVE(sem_wait);
+  RESOLVE(sem_timedwait);
+  RESOLVE(nanosleep);
+  RESOLVE(clock_nanosleep);
+  RESOLVE(usleep);
+  RESOLVE(sleep);
+  RESOLVE(mmap);
+  RESOLVE(munmap);
+  RESOLVE(open);
+  RESOLVE(open64);
+  RESOLVE(openat);
+  RESOLVE(close);
+  RESOLVE(read);
+  RESOLVE(write);
+  RESOLVE(fopen);
+  RESOLVE(fopen64);
+  RESOLVE(fclose);
+  RESOLVE(fread);
+  RESOLVE(fwrite);
+  RESOLVE(fflush);
+  RESOLVE(fputs);
+  RESOLVE(puts);
+  RESOLVE(vfprintf);
+  RESOLVE(__vfprintf_chk);
+}
+
+__attribute__((destructor))
+static void
+rtcheck_fini(void) {
+  if (checked_calls > 0) {
+    fprintf(stderr, "rtcheck: %lu audio calls without realtime violations\n", checked_calls);
+  }
+}
+
+static void
+violation(const char* function) {
+  static const char prefix[] = "rtcheck: ";
+  static const char suffix[] = "() called from the audio thread\n";
+  void* frames[64];
+
+  in_audio = 0;
+
+  // Raw writes, stdio may be what failed
+  if (write(STDERR_FILENO, prefix, sizeof(prefix) - 1) < 0 ||
+      write(STDERR_FILENO, function, strlen(function)) < 0 ||
+      write(STDERR_FILENO, suffix, sizeof(suffix) - 1) < 0) {
+    abort();
+  }
+
+  backtrace_symbols_fd(frames, backtrace(frames, 64), STDERR_FILENO);
+
+  abort();
+}
+
+#define CHECK(name) do { if (in_audio) { violation(name); } } while (0)
+
+void
+rtcheck_enter(void) {
+  in_audio = 1;
+  checked_calls++;
+}
+
+void
+rtcheck_leave(void) {
+  in_audio = 0;
+}
+
+void* malloc(size_t size) { CHECK("malloc"); return __libc_malloc(size); }
+void* calloc(size_t n, size_t size) { CHECK("calloc"); return __libc_calloc(n, size); }
+void* realloc(void* ptr, size_t size) { CHECK("realloc"); return __libc_realloc(ptr, size); }
+void free(void* ptr) { CHECK("free"); __libc_free(ptr); }
+
+int
+posix_memalign(void** ptr, size_t alignment, size_t size) {
+  CHECK("posix_memalign");
+  return next_posix_memalign(ptr, alignment, size);
+}
+
+void*
+aligned_alloc(size_t alignment, size_t size) {
+  CHECK("aligned_alloc");
+  return next_aligned_alloc(alignment, size);
+}
+
+void*
+memalign(size_t alignment, size_t size) {
+  CHECK("memalign");
+  return next_memalign(alignment, size);
+}
+
+void* valloc(size_t size) { CHECK("valloc"); return next_valloc(size); }
+
+int
+pthread_mutex_lock(pthread_mutex_t* mutex) {
+  CHECK("pthread_mutex_lock");
+  return next_pthread_mutex_lock(mutex);
+}
+
+int
+pthread_mutex_trylock(pthread_mutex_t* mutex) {
+  CHECK("pthread_mutex_trylock");
+  return next_pthread_mutex_trylock(mutex);
+}
+
+int
+pthread_cond_wait(pthread_cond_t* cond, pthread_mutex_t* mutex) {
+  CHECK("pthread_cond_wait");
+  return next_pthread_cond_wait(cond, mutex);
+}
+
+int
+pthread_cond_timedwait(pthread_cond_t* cond, pthread_mutex_t* mutex,
+                       const struct timespec* abstime) {
+  CHECK("pthread_cond_timedwait");
+  return next_pthread_cond_timedwait(cond, mutex, abstime);
+}
+
+int
+pthread_rwlock_rdlock(pthread_rwlock_t* lock) {
+  CHECK("pthread_rwlock_rdlock");
+  return next_pthread_rwlock_rdlock(lock);
+}
+
+int
+pthread_rwlock_wrlock(pthread_rwlock_t* lock) {
+  CHECK("pthread_rwlock_wrlock");
+  return next_pthread_rwlock_wrlock(lock);
+}
+
+int
+pthread_rwlock_tryrdlock(pthread_rwlock_t* lock) {
+  CHECK("pthread_rwlock_tryrdlock");
+  return next_pthread_rwlock_tryrdlock(lock);
+}
+
+int
+pthread_rwlock_trywrlock(pthread_rwlock_t* lock) {
+  CHECK("pthread_rwlock_trywrlock");
+  return next_pthread_rwlock_trywrlock(lock);
+}
+
+int
+pthread_rwlock_timedrdlock(pthread_rwlock_t* lock, const struct timespec* abstime) {
+  CHECK("pthread_rwlock_timedrdlock");
+  return next_pthread_rwlock_timedrdlock(lock, abstime);
+}
+
+int
+pthread_rwlock_timedwrlock(pthread_rwlock_t* lock, const struct timespec* abstime) {
+  CHECK("pthread_rwlock_timedwrlock");
+  return next_pthread_rwlock_timedwrlock(lock, abstime);
+}
+
+int sem_wait(sem_t* sem) { CHECK("sem_wait"); return next_sem_wait(sem); }
+
+int
+sem_timedwait(sem_t* sem, const struct timespec* abstime) {
+  CHECK("sem_timedwait");
+  return next_sem_timedwait(sem, abstime);
+}
+
+int
+nanosleep(const struct timespec* req, struct timespec* rem) {
+  CHECK("nanosleep");
+  return next_nanosleep(req, rem);
+}
+
+int
+clock_nanosleep(clockid_t clock, int flags, const struct timespec* req, struct timespec* rem) {
+  CHECK("clock_nanosleep");
+  return next_clock_nanosleep(clock, flags, req, rem);
+}
+
+int usleep(useconds_t usec) { CHECK("usleep"); return next_usleep(usec); }
+unsigned int sleep(unsigned int seconds) { CHECK("sleep"); return next_sleep(seconds); }
+
+void*
+mmap(void* addr, size_t length, int prot, int flags, int fd, off_t offset) {
+  CHECK("mmap");
+  return next_mmap(addr, length, prot, flags, fd, offset);
+}
+
+int munmap(void* addr, size_t length) { CHECK("munmap"); return next_munmap(addr, length); }
+
+int
+open(const char* path, int flags, ...) {
+  mode_t mode = 0;
+
+  CHECK("open");
+
+  if (flags & (O_CREAT | O_TMPFILE)) {
+    va_list args;
+    va_start(args, flags);
+    mode = va_arg(args, mode_t);
+    va_end(args);
+  }
+
+  return next_open(path, flags, mode);
+}
+
+int
+open64(const char* path, int flags, ...) {
+  mode_t mode = 0;
+
+  CHECK("open64");
+
+  if (flags & (O_CREAT | O_TMPFILE)) {
+    va_list args;
+    va_start(args, flags);
+    mode = va_arg(args, mode_t);
+    va_end(args);
+  }
+
+  return next_open64(path, flags, mode);
+}
+
+int
+openat(int dir_fd, const char* path, int flags, ...) {
+  mode_t mode = 0;
+
+  CHECK("openat");
+
+  if (flags & (O_CREAT | O_TMPFILE)) {
+    va_list args;
+    va_start(args, flags);
+    mode = va_arg(args, mode_t);
+    va_end(args);
+  }
+
+  return next_openat(dir_fd, path, flags, mode);
+}
+
+int close(int fd) { CHECK("close"); return next_close(fd); }
+ssize_t read(int fd, void* buf, size_t count) { CHECK("read"); return next_read(fd, buf, count); }
+ssize_t write(int fd, const void* buf, size_t count) { CHECK("write"); return next_write(fd, buf, count); }
+
+FILE* fopen(const char* path, const char* mode) { CHECK("fopen"); return next_fopen(path, mode); }
+FILE* fopen64(const char* path, const char* mode) { CHECK("fopen64"); return next_fopen64(path, mode); }
+int fclose(FILE* stream) { CHECK("fclose"); return next_fclose(stream); }
+
+size_t
+fread(void* ptr, size_t size, size_t n, FILE* stream) {
+  CHECK("fread");
+  return next_fread(ptr, size, n, stream);
+}
+
+size_t
+fwrite(const void* ptr, size_t size, size_t n, FILE* stream) {
+  CHECK("fwrite");
+  return next_fwrite(ptr, size, n, stream);
+}
+
+int fflush(FILE* stream) { CHECK("fflush"); return next_fflush(stream); }
+int fputs(const char* s, FILE* stream) { CHECK("fputs"); return next_fputs(s, stream); }
+int puts(const char* s) { CHECK("puts"); return next_puts(s); }
+
+int
+vfprintf(FILE* stream, const char* format, va_list args) {
+  CHECK("vfprintf");
+  return next_vfprintf(stream, format, args);
+}
+
+int
+fprintf(FILE* stream, const char* format, ...) {
+  CHECK("fprintf");
+
+  va_list args;
+  va_start(args, format);
+  int ret = next_vfprintf(stream, format, args);
+  va_end(args);
+
+  return ret;
+}
+
+int
+printf(const char* format, ...) {
+  CHECK("printf");
+
+  va_list args;
+  va_start(args, format);
+  int ret = next_vfprintf(stdout, format, args);
+  va_end(args);
+
+  return ret;
+}
+
+int
+__vfprintf_chk(FILE* stream, int flag, const char* format, va_list args) {
+  CHECK("__vfprintf_chk");
+  return next___vfprintf_chk(stream, flag, format, args);
+}
+
+int
+__fprintf_chk(FILE* stream, int flag, const char* format, ...) {
+  CHECK("__fprintf_chk");
+
+  va_list args;
+  va_start(args, format);
+  int ret = next___vfprintf_chk(stream, flag, format, args);
+  va_end(args);
+
+  return ret;
+}
+
+int
+__printf_chk(int flag, const char* format, ...) {
+  CHECK("__printf_chk");
+
+  va_list args;
+  va_start(args, format);
+  int ret = next___vfprintf_chk(stdout, flag, format, args);
+  va_end(args);
+
+  return ret;
+}